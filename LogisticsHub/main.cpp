@@ -18,6 +18,28 @@
 #include <random>
 #include <thread>
 #include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <chrono>
+#include <iomanip>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LH_X86 1
+#endif
 
 using namespace std;
 
@@ -53,6 +75,94 @@ struct opInfo{
     int iterations;
     vector<hub> finals;
     collection addon;
+    //Restarts run and given up on (a single given up run has abandoned 1)
+    int restarts = 0;
+    int abandoned = 0;
+    //Restart the result came from (-1 if it wasn't a single restart's)
+    int restart = -1;
+};
+//Optimisers available for each hub
+enum optimiser{
+    //Fixed step grid search
+    hillClimbing,
+    //Weiszfeld iteration for the weighted geometric median on the sphere
+    weiszfeld
+};
+//Ways of placing the starting hubs
+enum seeding{
+    //Uniform in the lat/long bounding box
+    uniformSeeding,
+    //k-means++: population and squared distance weighted over the places
+    kmeansSeeding
+};
+//Best result so far of a solve, written out as it improves
+struct anytime;
+//Travel costs from places to candidate sites
+struct costMatrix;
+//Structure for solver settings
+struct settings{
+    //Step (degrees) and scope of the hill climb
+    double search = 0.01;
+    int minMax = 10;
+    optimiser mode = hillClimbing;
+    seeding start = kmeansSeeding;
+    //Restart i draws from seed + i; a fresh seed is picked unless one is given
+    bool seeded = false;
+    uint64_t seed = 0;
+    //Progress messages for each restart
+    bool verbose = true;
+    //Start big place sets on merged grid cells at a larger step
+    bool coarse = false;
+    //Seconds to solve for (0 runs the number of restarts asked for), and
+    //the wallNs() time everything stops at (set by solve)
+    double budget = 0;
+    long long deadline = 0;
+    //Checkpoint file for improving results, and one to start restart 0 from
+    string snapshot;
+    string resume;
+    anytime *progress = nullptr;
+    //Give up restarts that fall too far behind the best so far
+    bool abandon = false;
+    //Hill climb on float32 fitnesses, then polish with exact ones
+    bool approx = false;
+    //Run tempering chains instead of independent restarts
+    bool temper = false;
+    //Number of the first restart, so shards of one job run different restarts
+    int firstRestart = 0;
+    //Hubs sit on this matrix's sites and are priced by it, if one is given
+    const costMatrix *costs = nullptr;
+};
+//Structure for one scenario of a batch run
+struct scenario{
+    int hubs = 1;
+    int restarts = 1;
+    //Accuracy in km, as asked for interactively
+    double accuracy = 1;
+    //Whether to work out round trips for each hub
+    bool routes = true;
+    //Solve every hub count from 1 up to hubs, each grown from the last
+    bool sweep = false;
+    //Only places with at least minPop people, inside the region if one is given (degrees)
+    double minPop = 0;
+    bool region = false;
+    double minLat = -90, maxLat = 90, minLon = -180, maxLon = 180;
+    //Echoed back with the result, for matching server replies to queries
+    string tag;
+    settings opts;
+};
+//Structure for a k-d tree over unit vectors
+//(implicit: the node for the range [lo, hi) sits at (lo + hi)/2)
+struct kdTree{
+    //Point ids and coordinates (x, y, z interleaved) in tree order
+    vector<int> ids;
+    vector<double> pts;
+    //Splitting axis of each node
+    vector<int> axis;
+    //Points left in each node's range, and which have been taken out (for removals)
+    vector<int> alive;
+    vector<char> dead;
+    //Tree position of each id
+    vector<int> slot;
 };
 //Structure to contain data on places
 struct placesInfo{
@@ -61,6 +171,444 @@ struct placesInfo{
     //Strings in csv
     vector<vector<string> > names;
 };
+//Read-only column of numbers, held by a table's storage (a view picks its
+//rows through index instead of copying them)
+struct column{
+    const double *data = nullptr;
+    const int *index = nullptr;
+    size_t count = 0;
+    double operator[](size_t i) const{
+        return index == nullptr ? data[i] : data[index[i]];
+    }
+    size_t size() const{
+        return count;
+    }
+};
+//Structure of arrays for places, built once after getPlaces (angles in radians)
+struct placeTable{
+    column lat;
+    column lon;
+    //cos(lat) is needed by every haversine so is kept alongside
+    column cosLat;
+    column pop;
+    //Unit vectors, used by the batched kernels (chord length instead of haversine)
+    column x;
+    column y;
+    column z;
+    //Keeps the columns alive, either a heap block or a mapped dataset file
+    shared_ptr<const void> storage;
+};
+//Number of columns in a place table
+const int tableColumns = 7;
+//Structure for place names, packed into one string pool
+struct nameTable{
+    //Name i is chars[offsets[i]] up to chars[offsets[i+1]]
+    const uint64_t *offsets = nullptr;
+    const char *chars = nullptr;
+    shared_ptr<const void> storage;
+};
+//Structure for a loaded dataset
+struct dataset{
+    placeTable places;
+    nameTable names;
+};
+//Header of the binary dataset format (see writeDataset)
+struct datasetHeader{
+    char magic[8];
+    uint64_t count;
+    uint64_t nameBytes;
+    uint64_t reserved[5];
+};
+const char datasetMagic[8] = {'L', 'H', 'U', 'B', 'P', 'L', 'C', '1'};
+//Header of a binary cost matrix (.lhc)
+struct costHeader{
+    char magic[8];
+    uint64_t places;
+    uint64_t sites;
+    //Non-zero when site i is place i (and sites == places)
+    uint64_t square;
+    uint64_t reserved[4];
+};
+const char costMagic[8] = {'L', 'H', 'U', 'B', 'C', 'S', 'T', '1'};
+//Structure for a mapped cost matrix, costs from every place to every candidate site
+struct costMatrix{
+    size_t places = 0;
+    size_t sites = 0;
+    bool square = false;
+    //Site positions (degrees)
+    const double *siteLat = nullptr;
+    const double *siteLon = nullptr;
+    //One column of places costs per site
+    const float *costs = nullptr;
+    shared_ptr<const void> storage;
+    const float *column(size_t site) const{
+        return costs + site*places;
+    }
+    float operator()(size_t place, size_t site) const{
+        return costs[site*places + place];
+    }
+};
+//Structure for a batch of candidate hub positions (unit vectors)
+struct candidates{
+    vector<double> x;
+    vector<double> y;
+    vector<double> z;
+};
+//Structure for carrying assignments between multiBALL passes: per place,
+//an upper bound on the distance to its hub and a lower bound on the
+//distance to any other (km), valid for the hubs as they were
+struct assignBounds{
+    vector<hub> hubs;
+    vector<int> connections;
+    vector<double> upper;
+    vector<double> lower;
+};
+//Structure for fitnesses already found on a hub's hill-climb lattice, the
+//points (lat + i*step, lon + j*step) keyed on (i, j), only valid for the
+//places they were found over
+struct latticeCache{
+    double lat = 0;
+    double lon = 0;
+    double step = 0;
+    unordered_map<uint64_t, double> fits;
+};
+
+/*
+ Thread pool
+ Created once per run and sized to the hardware. Each worker has its own
+ deque (newest task first) and steals the oldest task from the others when
+ it runs dry. A worker waiting on a group runs other tasks meanwhile, so
+ tasks can safely wait on tasks they submitted themselves. Threads outside
+ the pool sleep until their group is done, so the pool's size is the number
+ of threads busy.
+*/
+//Structure counting the outstanding tasks of a group
+struct taskGroup{
+    atomic<int> pending{0};
+};
+
+class threadPool{
+public:
+    threadPool(int size){
+        stopping = false;
+        queued = 0;
+        for(int i = 0; i < size; i++){
+            queues.push_back(unique_ptr<workQueue>(new workQueue));
+        }
+        for(int i = 0; i < size; i++){
+            workers.push_back(thread(&threadPool::work, this, i));
+        }
+    }
+    
+    ~threadPool(){
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto& th : workers){
+            th.join();
+        }
+    }
+    
+    int size(){
+        return (int)workers.size();
+    }
+    
+    //Index of the calling worker, -1 for threads outside the pool
+    static int current(){
+        return owner != nullptr ? self : -1;
+    }
+    
+    //Adding a task (to the caller's own queue when called from a worker)
+    void submit(taskGroup &group, function<void()> task){
+        group.pending++;
+        int target = self >= 0 && owner == this ? self : (int)(next++ % queues.size());
+        {
+            lock_guard<mutex> guard(queues[target]->lock);
+            queues[target]->tasks.push_back([this, &group, task](){
+                task();
+                if(--group.pending == 0){
+                    //Taking the lock so a waiter can't miss this between checking and sleeping
+                    {
+                        lock_guard<mutex> guard(sleepLock);
+                    }
+                    wake.notify_all();
+                    done.notify_all();
+                }
+            });
+        }
+        {
+            lock_guard<mutex> guard(sleepLock);
+            queued++;
+        }
+        wake.notify_one();
+    }
+    
+    //Waiting for a group, running tasks in the meantime if called from a worker
+    void wait(taskGroup &group){
+        bool worker = owner == this;
+        while(group.pending > 0){
+            if(worker && runOne(self)){
+                continue;
+            }
+            unique_lock<mutex> guard(sleepLock);
+            if(worker){
+                wake.wait(guard, [&](){ return group.pending == 0 || queued > 0; });
+            }else{
+                done.wait(guard, [&](){ return group.pending == 0; });
+            }
+        }
+    }
+    
+private:
+    struct workQueue{
+        mutex lock;
+        deque< function<void()> > tasks;
+    };
+    vector< unique_ptr<workQueue> > queues;
+    vector<thread> workers;
+    mutex sleepLock;
+    //Workers sleep on wake (new tasks), other threads on done (finished groups)
+    condition_variable wake;
+    condition_variable done;
+    bool stopping;
+    int queued;
+    atomic<unsigned> next{0};
+    //Which pool and queue the current thread works for
+    static thread_local threadPool *owner;
+    static thread_local int self;
+    
+    //Running one task, own queue first and then stealing, false if none found
+    bool runOne(int from){
+        function<void()> task;
+        int n = (int)queues.size();
+        for(int k = 0; k < n && !task; k++){
+            int q = from >= 0 ? (from + k) % n : (int)((next + k) % n);
+            lock_guard<mutex> guard(queues[q]->lock);
+            if(!queues[q]->tasks.empty()){
+                if(q == from){
+                    task = move(queues[q]->tasks.back());
+                    queues[q]->tasks.pop_back();
+                }else{
+                    task = move(queues[q]->tasks.front());
+                    queues[q]->tasks.pop_front();
+                }
+            }
+        }
+        if(!task){
+            return false;
+        }
+        {
+            lock_guard<mutex> guard(sleepLock);
+            queued--;
+        }
+        task();
+        return true;
+    }
+    
+    void work(int index){
+        owner = this;
+        self = index;
+        while(true){
+            if(!runOne(index)){
+                unique_lock<mutex> guard(sleepLock);
+                wake.wait(guard, [this](){ return stopping || queued > 0; });
+                if(stopping && queued == 0){
+                    return;
+                }
+            }
+        }
+    }
+};
+thread_local threadPool *threadPool::owner = nullptr;
+thread_local int threadPool::self = -1;
+
+//Threads for the pool, one per hardware thread unless set (before first use)
+int poolThreads = 0;
+
+//The pool shared by the whole run
+threadPool &pool(){
+    static threadPool workers(poolThreads > 0 ? poolThreads : max(1, (int)thread::hardware_concurrency()));
+    return workers;
+}
+
+/*
+ Instrumentation
+ Off unless --profile is given. Counters are relaxed atomics bumped once per
+ kernel call, not per distance. Phase timers measure wall and thread CPU
+ time; a phase started inside another (e.g. a pool wait that picks up an
+ unrelated task) pauses the outer one, so each thread's time is counted once.
+*/
+enum phase{
+    loadPhase,
+    seedPhase,
+    optimisePhase,
+    assignPhase,
+    routePhase,
+    phaseCount
+};
+const char *phaseNames[phaseCount] = {"load", "seed", "optimise", "assign", "routes"};
+
+//Structure for the run's counters and timers
+struct profiler{
+    bool enabled = false;
+    atomic<long long> distances{0};
+    //Hub optimisations and the iterations they took
+    atomic<long long> optimisations{0};
+    atomic<long long> optimiseIterations{0};
+    atomic<long long> optimiseMax{0};
+    //multiBALL runs and their outer iterations
+    atomic<long long> multiRuns{0};
+    atomic<long long> multiIterations{0};
+    //Restarts given up on
+    atomic<long long> abandoned{0};
+    atomic<long long> calls[phaseCount];
+    atomic<long long> wallNs[phaseCount];
+    atomic<long long> cpuNs[phaseCount];
+    //Restarts done by each pool worker (last slot for other threads)
+    mutex restartLock;
+    vector<long long> restarts;
+};
+
+profiler &profile(){
+    static profiler run;
+    return run;
+}
+
+void resetProfile(){
+    profiler &run = profile();
+    run.distances = 0;
+    run.optimisations = 0;
+    run.optimiseIterations = 0;
+    run.optimiseMax = 0;
+    run.multiRuns = 0;
+    run.multiIterations = 0;
+    run.abandoned = 0;
+    for(int p = 0; p < phaseCount; p++){
+        run.calls[p] = 0;
+        run.wallNs[p] = 0;
+        run.cpuNs[p] = 0;
+    }
+    lock_guard<mutex> guard(run.restartLock);
+    run.restarts.assign(pool().size() + 1, 0);
+}
+
+inline void countDistances(long long n){
+    if(profile().enabled){
+        profile().distances.fetch_add(n, memory_order_relaxed);
+    }
+}
+
+void countOptimise(long long iterations){
+    profiler &run = profile();
+    if(run.enabled){
+        run.optimisations++;
+        run.optimiseIterations += iterations;
+        long long seen = run.optimiseMax;
+        while(iterations > seen && !run.optimiseMax.compare_exchange_weak(seen, iterations)){}
+    }
+}
+
+void countMulti(long long iterations){
+    if(profile().enabled){
+        profile().multiRuns++;
+        profile().multiIterations += iterations;
+    }
+}
+
+void countAbandoned(){
+    if(profile().enabled){
+        profile().abandoned++;
+    }
+}
+
+void countRestart(){
+    profiler &run = profile();
+    if(run.enabled){
+        lock_guard<mutex> guard(run.restartLock);
+        int worker = threadPool::current();
+        run.restarts[worker >= 0 ? worker : run.restarts.size() - 1]++;
+    }
+}
+
+long long threadCpuNs(){
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec*1000000000LL + now.tv_nsec;
+}
+
+long long wallNs(){
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Timing a phase for as long as it is in scope
+class phaseTimer{
+public:
+    phaseTimer(phase which) : which(which), outer(top){
+        active = profile().enabled;
+        if(!active){
+            return;
+        }
+        profile().calls[which]++;
+        if(outer != nullptr){
+            outer->stop();
+        }
+        top = this;
+        start();
+    }
+    
+    ~phaseTimer(){
+        if(!active){
+            return;
+        }
+        stop();
+        top = outer;
+        if(outer != nullptr){
+            outer->start();
+        }
+    }
+    
+private:
+    phase which;
+    phaseTimer *outer;
+    bool active;
+    long long wall0, cpu0;
+    static thread_local phaseTimer *top;
+    
+    void start(){
+        wall0 = wallNs();
+        cpu0 = threadCpuNs();
+    }
+    
+    void stop(){
+        profile().wallNs[which] += wallNs() - wall0;
+        profile().cpuNs[which] += threadCpuNs() - cpu0;
+    }
+};
+thread_local phaseTimer *phaseTimer::top = nullptr;
+
+//Writing the report as JSON (wall is summed over threads, like cpu)
+void writeProfile(ostream &out){
+    profiler &run = profile();
+    out << setprecision(6) << "{\"phases\":{";
+    for(int p = 0; p < phaseCount; p++){
+        out << (p ? "," : "") << "\"" << phaseNames[p] << "\":{\"calls\":" << run.calls[p];
+        out << ",\"wall_s\":" << run.wallNs[p]/1e9 << ",\"cpu_s\":" << run.cpuNs[p]/1e9 << "}";
+    }
+    out << "},\"distance_evaluations\":" << run.distances;
+    out << ",\"hub_optimisations\":" << run.optimisations;
+    out << ",\"optimise_iterations\":{\"total\":" << run.optimiseIterations << ",\"mean_per_hub\":";
+    out << (run.optimisations > 0 ? (double)run.optimiseIterations/run.optimisations : 0) << ",\"max_per_hub\":" << run.optimiseMax << "}";
+    out << ",\"multiBALL\":{\"runs\":" << run.multiRuns << ",\"iterations\":" << run.multiIterations << ",\"abandoned\":" << run.abandoned << "}";
+    out << ",\"restarts_per_thread\":[";
+    lock_guard<mutex> guard(run.restartLock);
+    for(int i = 0; i < run.restarts.size(); i++){
+        out << (i ? "," : "") << run.restarts[i];
+    }
+    out << "]}\n";
+    out.flush();
+}
 
 /*
  Functions
@@ -144,8 +692,254 @@ placesInfo getPlaces(string fileName){
     return output;
 }
 
+//Pointing a table's columns at a block of tableColumns*n numbers
+void setColumns(placeTable &table, const double *base, size_t n){
+    column *columns[tableColumns] = {&table.lat, &table.lon, &table.cosLat, &table.pop, &table.x, &table.y, &table.z};
+    for(int c = 0; c < tableColumns; c++){
+        columns[c]->data = base + c*n;
+        columns[c]->count = n;
+    }
+}
+
+//Making a table of n places on the heap, returns the block to fill in
+double *allocTable(placeTable &table, size_t n){
+    shared_ptr< vector<double> > block = make_shared< vector<double> >(tableColumns*n);
+    setColumns(table, block->data(), n);
+    table.storage = block;
+    return block->data();
+}
+
+//Filling in place i of a heap block (lat/long in degrees)
+void setPlace(double *base, size_t n, size_t i, double lat, double lon, double pop){
+    double la = lat*convert;
+    double lo = lon*convert;
+    base[i] = la;
+    base[n + i] = lo;
+    base[2*n + i] = cos(la);
+    base[3*n + i] = pop;
+    base[4*n + i] = cos(la)*cos(lo);
+    base[5*n + i] = cos(la)*sin(lo);
+    base[6*n + i] = sin(la);
+}
+
+//Building the place table from the csv numbers
+placeTable getTable(const vector< vector<double> > &nums){
+    placeTable table;
+    double *base = allocTable(table, nums.size());
+    for(int i = 0; i < nums.size(); i++){
+        setPlace(base, nums.size(), i, nums[i][3], nums[i][4], nums[i][2]);
+    }
+    return table;
+}
+
+//Viewing some rows of a table without copying them (ids must outlive the view)
+placeTable subView(const placeTable &from, const vector<int> &ids){
+    placeTable table = from;
+    const int *index = ids.data();
+    if(from.lat.index != nullptr){
+        //A view of a view gets its own index into the full table
+        shared_ptr< vector<int> > composed = make_shared< vector<int> >(ids.size());
+        for(size_t i = 0; i < ids.size(); i++){
+            (*composed)[i] = from.lat.index[ids[i]];
+        }
+        table.storage = make_shared< pair< shared_ptr<const void>, shared_ptr< vector<int> > > >(from.storage, composed);
+        index = composed->data();
+    }
+    column *columns[tableColumns] = {&table.lat, &table.lon, &table.cosLat, &table.pop, &table.x, &table.y, &table.z};
+    for(int c = 0; c < tableColumns; c++){
+        columns[c]->index = index;
+        columns[c]->count = ids.size();
+    }
+    return table;
+}
+
+//Row of place i in the table a view was taken from
+inline int placeRow(const placeTable &places, int i){
+    return places.lat.index == nullptr ? i : places.lat.index[i];
+}
+
+//Making a name table from offsets into a string pool
+nameTable makeNames(shared_ptr< vector<uint64_t> > offsets, shared_ptr<string> chars){
+    nameTable names;
+    names.offsets = offsets->data();
+    names.chars = chars->data();
+    names.storage = make_shared< pair< shared_ptr< vector<uint64_t> >, shared_ptr<string> > >(offsets, chars);
+    return names;
+}
+
+//Packing csv names into a string pool
+nameTable getNames(const vector< vector<string> > &raw){
+    shared_ptr< vector<uint64_t> > offsets = make_shared< vector<uint64_t> >(1, 0);
+    shared_ptr<string> chars = make_shared<string>();
+    for(int i = 0; i < raw.size(); i++){
+        *chars += raw[i][0];
+        offsets->push_back(chars->size());
+    }
+    return makeNames(offsets, chars);
+}
+
+//Name of place i
+string getName(const nameTable &names, int i){
+    return string(names.chars + names.offsets[i], names.chars + names.offsets[i+1]);
+}
+
+/*
+ Binary dataset (.lhb)
+ Native-endian, written once by --convert and then mapped straight into
+ memory, so opening takes milliseconds and concurrent runs share the pages.
+   datasetHeader (64 bytes)
+   lat, lon, cosLat, pop, x, y, z    count doubles each (angles in radians)
+   name offsets                      count+1 uint64s into the string pool
+   string pool                       nameBytes chars
+*/
+void writeDataset(const dataset &data, string fileName){
+    const placeTable &table = data.places;
+    const nameTable &names = data.names;
+    size_t n = table.lat.size();
+    
+    datasetHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, datasetMagic, sizeof(header.magic));
+    header.count = n;
+    header.nameBytes = names.offsets[n];
+    
+    ofstream file(fileName, ios::binary);
+    if(!file.is_open()){
+        cout << fileName << " couldn't be written!" << "\n";
+        exit(1);
+    }
+    file.write((const char *)&header, sizeof(header));
+    const column *columns[tableColumns] = {&table.lat, &table.lon, &table.cosLat, &table.pop, &table.x, &table.y, &table.z};
+    for(int c = 0; c < tableColumns; c++){
+        if(columns[c]->index == nullptr){
+            file.write((const char *)columns[c]->data, n*sizeof(double));
+        }else{
+            for(size_t i = 0; i < n; i++){
+                double value = (*columns[c])[i];
+                file.write((const char *)&value, sizeof(double));
+            }
+        }
+    }
+    file.write((const char *)names.offsets, (n + 1)*sizeof(uint64_t));
+    file.write(names.chars, header.nameBytes);
+    file.close();
+    cout << "Wrote " << n << " places to " << fileName << "\n";
+}
+
+//Mapping a binary dataset
+dataset mapDataset(string fileName){
+    dataset output;
+    int fd = open(fileName.c_str(), O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0){
+        cout << fileName << " didn't open!" << "\n";
+        exit(1);
+    }
+    size_t bytes = info.st_size;
+    void *mapped = bytes >= sizeof(datasetHeader) ? mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(mapped == MAP_FAILED){
+        cout << fileName << " couldn't be mapped!" << "\n";
+        exit(1);
+    }
+    shared_ptr<const void> storage(mapped, [bytes](const void *p){ munmap((void *)p, bytes); });
+    
+    //Checking the header against the file size
+    const datasetHeader *header = (const datasetHeader *)mapped;
+    size_t n = header->count;
+    size_t expected = sizeof(datasetHeader) + tableColumns*n*sizeof(double) + (n + 1)*sizeof(uint64_t) + header->nameBytes;
+    if(memcmp(header->magic, datasetMagic, sizeof(header->magic)) != 0 || expected != bytes){
+        cout << fileName << " isn't a valid dataset!" << "\n";
+        exit(1);
+    }
+    //Bigger than memory, so let the kernel stream it through in order
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if(pages > 0 && pageSize > 0 && bytes > (size_t)pages*pageSize){
+        madvise(mapped, bytes, MADV_SEQUENTIAL);
+    }else{
+        madvise(mapped, bytes, MADV_WILLNEED);
+    }
+    
+    const double *base = (const double *)((const char *)mapped + sizeof(datasetHeader));
+    setColumns(output.places, base, n);
+    output.places.storage = storage;
+    output.names.offsets = (const uint64_t *)(base + tableColumns*n);
+    output.names.chars = (const char *)(output.names.offsets + n + 1);
+    output.names.storage = storage;
+    cout << "Mapped all " << n << " entries from " << fileName << "!\n";
+    return output;
+}
+
+/*
+ Cost matrices (.lhc)
+ Travel costs worked out offline (roads, ferries...) from every place to a
+ set of candidate sites, mapped rather than read so they can be far bigger
+ than memory. Costs are stored a site at a time, so scoring a site reads one
+ contiguous column and assigning reads the same block of rows from each
+ hub's column.
+   costHeader (64 bytes)
+   site lat, site lon                sites doubles each (degrees)
+   costs                             sites columns of places floats
+ A square matrix (sites are the places, in order) also prices the round trips.
+*/
+costMatrix mapCosts(string fileName){
+    costMatrix output;
+    int fd = open(fileName.c_str(), O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0){
+        cout << fileName << " didn't open!" << "\n";
+        exit(1);
+    }
+    size_t bytes = info.st_size;
+    void *mapped = bytes >= sizeof(costHeader) ? mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(mapped == MAP_FAILED){
+        cout << fileName << " couldn't be mapped!" << "\n";
+        exit(1);
+    }
+    output.storage = shared_ptr<const void>(mapped, [bytes](const void *p){ munmap((void *)p, bytes); });
+    const costHeader *header = (const costHeader *)mapped;
+    output.places = header->places;
+    output.sites = header->sites;
+    output.square = header->square != 0 && output.sites == output.places;
+    size_t expected = sizeof(costHeader) + 2*output.sites*sizeof(double) + output.sites*output.places*sizeof(float);
+    if(memcmp(header->magic, costMagic, sizeof(header->magic)) != 0 || expected != bytes){
+        cout << fileName << " isn't a valid cost matrix!" << "\n";
+        exit(1);
+    }
+    //Columns are read a block at a time, in no particular site order
+    madvise(mapped, bytes, MADV_RANDOM);
+    output.siteLat = (const double *)((const char *)mapped + sizeof(costHeader));
+    output.siteLon = output.siteLat + output.sites;
+    output.costs = (const float *)(output.siteLon + output.sites);
+    cout << "Mapped costs from " << output.places << " places to " << output.sites << " sites from " << fileName << "!\n";
+    return output;
+}
+
+//Loading a dataset, mapped if binary and parsed if csv
+dataset loadDataset(string fileName){
+    dataset output;
+    if(fileName.size() > 4 && fileName.compare(fileName.size() - 4, 4, ".lhb") == 0){
+        return mapDataset(fileName);
+    }
+    placesInfo information = getPlaces(fileName);
+    output.places = getTable(information.nums);
+    output.names = getNames(information.names);
+    return output;
+}
+
+//Adding a candidate hub position (in degrees) to a batch
+void addCandidate(candidates &batch, double lat, double lon){
+    double la = lat*convert;
+    double lo = lon*convert;
+    batch.x.push_back(cos(la)*cos(lo));
+    batch.y.push_back(cos(la)*sin(lo));
+    batch.z.push_back(sin(la));
+}
+
 //Getting lat/long bounds
-bounds getBounds(vector< vector<double> > places){
+bounds getBounds(const placeTable &places){
     bounds newBounds;
     
     //Finding boundaries for lat/long
@@ -154,23 +948,23 @@ bounds getBounds(vector< vector<double> > places){
     double maxLong = -INFINITY;
     double minLong = INFINITY;
     //scanning through lat/long values
-    for(int i = 0; i < places.size(); i++){
-        if(minLat > places[i][3]){
-            minLat = places[i][3];
-        }if(maxLat < places[i][3]){
-            maxLat = places[i][3];
-        }
-        if(minLong > places[i][4]){
-            minLong = places[i][4];
-        }if(maxLong < places[i][4]){
-            maxLong = places[i][4];
-        }
-    }
-    //Setting variable values
-    newBounds.maxLat = maxLat;
-    newBounds.minLat = minLat;
-    newBounds.maxLong = maxLong;
-    newBounds.minLong = minLong;
+    for(int i = 0; i < places.lat.size(); i++){
+        if(minLat > places.lat[i]){
+            minLat = places.lat[i];
+        }if(maxLat < places.lat[i]){
+            maxLat = places.lat[i];
+        }
+        if(minLong > places.lon[i]){
+            minLong = places.lon[i];
+        }if(maxLong < places.lon[i]){
+            maxLong = places.lon[i];
+        }
+    }
+    //Setting variable values (back in degrees)
+    newBounds.maxLat = maxLat/convert;
+    newBounds.minLat = minLat/convert;
+    newBounds.maxLong = maxLong/convert;
+    newBounds.minLong = minLong/convert;
     return newBounds;
 }
 
@@ -211,319 +1005,3430 @@ double dist(double startLat, double endLat, double startLong, double endLong, do
     return R*b;
 }
 
+//Finding non-weighted distance from a point (radians, cos(lat) precomputed) to a place in the table
+inline double tDist(double lat, double lon, double cosLat, const placeTable &places, int i){
+    double sLat = sin((places.lat[i]-lat)/2);
+    double sLong = sin((places.lon[i]-lon)/2);
+    
+    double a = sLat*sLat + cosLat*places.cosLat[i]*sLong*sLong;
+    
+    return R*2*atan2(sqrt(a) , sqrt(1.0-a));
+}
+
+//Finding non-weighted distance between two places in the table
+inline double pDist(const placeTable &places, int j, int k){
+    return tDist(places.lat[j], places.lon[j], places.cosLat[j], places, k);
+}
+
+/*
+ Chunked reductions
+ Sums over the places are split into fixed-size chunks, each chunk summed
+ with Neumaier compensation and the chunk totals added in chunk order. The
+ chunks don't depend on the number of threads, so neither does the result.
+*/
+//Places per chunk
+const int reduceChunk = 16384;
+
+//Structure for a compensated (Neumaier) sum
+struct stableSum{
+    double sum = 0;
+    double carry = 0;
+    void add(double value){
+        double next = sum + value;
+        if(fabs(sum) >= fabs(value)){
+            carry += (sum - next) + value;
+        }else{
+            carry += (value - next) + sum;
+        }
+        sum = next;
+    }
+    double total() const{
+        return sum + carry;
+    }
+};
+
+//Number of chunks n places split into
+int chunksOf(size_t n){
+    return (int)((n + reduceChunk - 1)/reduceChunk);
+}
+
+//Running body(chunk, begin, end) for every chunk, on the pool when there's more than one
+template<class F>
+void forChunks(size_t n, F body){
+    int chunks = chunksOf(n);
+    if(chunks <= 1){
+        body(0, 0, (int)n);
+        return;
+    }
+    taskGroup group;
+    for(int c = 0; c < chunks; c++){
+        pool().submit(group, [&, c](){
+            body(c, c*reduceChunk, (int)min(n, (size_t)(c + 1)*reduceChunk));
+        });
+    }
+    pool().wait(group);
+}
+
+//Adding up chunk totals in order
+double sumChunks(const vector<stableSum> &partial){
+    stableSum output;
+    for(int c = 0; c < partial.size(); c++){
+        output.add(partial[c].total());
+    }
+    return output.total();
+}
+
 //Finding the fitness of a single hub
-double findFitness(double lat, double lon, vector< vector<double> > places){
-    //Inital fitness is zero
-    double fitness = 0;
-    for(int i=0; i < places.size(); i++){
-        //Add the weighted distance to each place
-        fitness += hDist(lat, places[i][3], lon, places[i][4], places[i][2]);
+double findFitness(double lat, double lon, const placeTable &places){
+    //Converting the hub once rather than for every place
+    double la = lat*convert;
+    double lo = lon*convert;
+    double cosLa = cos(la);
+    countDistances(places.lat.size());
+    //Inital fitness is zero for every chunk
+    vector<stableSum> partial(max(chunksOf(places.lat.size()), 1));
+    forChunks(places.lat.size(), [&](int c, int begin, int end){
+        for(int i = begin; i < end; i++){
+            //Add the weighted distance to each place
+            partial[c].add(tDist(la, lo, cosLa, places, i)*places.pop[i]);
+        }
+    });
+    return sumChunks(partial);
+}
+
+/*
+ Batched fitness kernels
+ Every candidate is evaluated against each place in a single pass over the
+ places. Distances come from the chord between unit vectors, d = 2R*asin(c/2).
+ The SIMD versions have no vector asin so use a 16 term Taylor series, which
+ is good to ~1e-15 relative for h <= asinDirect (about 3200km). Further than
+ that the angle is halved twice first (asin(h) = 2*asin(h/sqrt(2(1+sqrt(1-h*h))))).
+*/
+const int asinTerms = 16;
+const double asinDirect = 0.25;
+const int batchPad = 8;
+//Places per task when a batch is split over the pool
+const int batchChunk = 8192;
+//Hub count from which findDualFitnesses uses a k-d tree
+const int kdMinHubs = 16;
+
+//Taylor series coefficients for asin(x)/x in powers of x^2
+vector<double> makeAsinCoefs(){
+    vector<double> coefs(1, 1.0);
+    for(int k = 1; k < asinTerms; k++){
+        coefs.push_back(coefs[k-1]*(2*k-1)*(2*k-1)/((2.0*k)*(2*k+1)));
     }
-    return fitness;
+    return coefs;
+}
+const vector<double> &asinCoefs(){
+    static const vector<double> coefs = makeAsinCoefs();
+    return coefs;
 }
 
-//Finding the fitness of multiple hubs, all connected to different places and those connections
-collection findDualFitnesses(vector< hub > dualHubs, vector< vector<double> > places){
-    //setting variables
-    collection col;
-    
-    vector< int > connections;
-    
-    double bestFitness;
-    double fitness = 0;
-    int best;
-    //Starting the loop
-    for(int i = 0; i < places.size(); i++){
-        //Best fitness so far is unknown
-        bestFitness = INFINITY;
-        //Loop through all the hubs
-        for(int j = 0; j < dualHubs.size(); j++){
-            //Looking for best fitness
-            if(bestFitness > hDist(dualHubs[j].lat, places[i][3], dualHubs[j].lon, places[i][4], places[i][2])){
-                //letting the program know a best fitness so far has been found
-                bestFitness = hDist(dualHubs[j].lat, places[i][3], dualHubs[j].lon, places[i][4], places[i][2]);
-                best = j;
-            }
+//Scalar fallback
+void batchScalar(const double *cx, const double *cy, const double *cz, int count, const placeTable &places, int begin, int end, double *out){
+    double dx, dy, dz, h, w;
+    for(int i = begin; i < end; i++){
+        w = 2*R*places.pop[i];
+        for(int c = 0; c < count; c++){
+            dx = cx[c]-places.x[i];
+            dy = cy[c]-places.y[i];
+            dz = cz[c]-places.z[i];
+            h = 0.5*sqrt(dx*dx + dy*dy + dz*dz);
+            out[c] += w*asin(h < 1 ? h : 1);
         }
-        //Adding on the best connection to the pile
-        fitness += bestFitness;
-        connections.push_back(best);
     }
-    //Outputting results
-    col.connections = connections;
-    col.fitness = fitness;
-    return col;
 }
 
-//Hill climb calculations
-void hillClimb(hub &startHub, double search, vector<vector<double>> places, bool &changing, int minMax){
-    double currentFit, testFit;
-    double dx=0;
-    double dy=0;
-    currentFit = startHub.fitness;
-    //Having a look around (User defined)
-    for(int i = -minMax; i <= minMax; i++){
-        for(int j = -minMax; j <= minMax; j++){
-            if(i != 0 || j != 0){
-                //Having a look around
-                testFit = findFitness(startHub.lat + i*search, startHub.lon + j*search, places);
-                //Seeing if found a better fit
-                if(testFit < currentFit){
-                    changing=true;
-                    dx = i*search;
-                    dy = j*search;
-                    currentFit = testFit;
+#ifdef LH_X86
+//AVX2 version, 4 candidates per instruction
+__attribute__((target("avx2,fma")))
+void batchAVX2(const double *cx, const double *cy, const double *cz, int count, const placeTable &places, int begin, int end, double *out){
+    const vector<double> &coefs = asinCoefs();
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d direct = _mm256_set1_pd(asinDirect);
+    __m256d cf[asinTerms];
+    for(int k = 0; k < asinTerms; k++){
+        cf[k] = _mm256_set1_pd(coefs[k]);
+    }
+    __m256d px, py, pz, w, dx, dy, dz, h, t, p, scale;
+    for(int i = begin; i < end; i++){
+        px = _mm256_set1_pd(places.x[i]);
+        py = _mm256_set1_pd(places.y[i]);
+        pz = _mm256_set1_pd(places.z[i]);
+        w = _mm256_set1_pd(2*R*places.pop[i]);
+        for(int c = 0; c < count; c += 4){
+            dx = _mm256_sub_pd(_mm256_loadu_pd(cx+c), px);
+            dy = _mm256_sub_pd(_mm256_loadu_pd(cy+c), py);
+            dz = _mm256_sub_pd(_mm256_loadu_pd(cz+c), pz);
+            h = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dz, dz)));
+            h = _mm256_min_pd(_mm256_mul_pd(_mm256_sqrt_pd(h), half), one);
+            scale = w;
+            //Halving the angle twice if any lane is too far for the series
+            if(_mm256_movemask_pd(_mm256_cmp_pd(h, direct, _CMP_GT_OQ))){
+                for(int k = 0; k < 2; k++){
+                    h = _mm256_div_pd(h, _mm256_sqrt_pd(_mm256_mul_pd(two, _mm256_add_pd(one, _mm256_sqrt_pd(_mm256_fnmadd_pd(h, h, one))))));
                 }
+                scale = _mm256_mul_pd(w, four);
             }
+            t = _mm256_mul_pd(h, h);
+            p = cf[asinTerms-1];
+            for(int k = asinTerms-2; k >= 0; k--){
+                p = _mm256_fmadd_pd(p, t, cf[k]);
+            }
+            _mm256_storeu_pd(out+c, _mm256_fmadd_pd(scale, _mm256_mul_pd(h, p), _mm256_loadu_pd(out+c)));
         }
     }
-    //Editing hub
-    startHub.lat += dx;
-    startHub.lon += dy;
-    startHub.fitness=currentFit;
-    
 }
 
-//Optimising for _____single______ hub
-opInfo optimise(vector< hub > hubs, vector< vector<double> > places, double search, int minMax){
-    opInfo output;
-    vector< hub > newHubs = hubs;
-    
-    //Relocating hubs
-    bool changing = true;
-    int iterations = 0;
-    
-    vector<thread> threads;
-    //Starting the loop to find local minimum(s)
-    while(changing){
-        //Seeing how many iterations it took
-        iterations++;
-        changing = false;
-        //Looping through the hubs
-        for(int k = 0; k < newHubs.size(); k++){
-            //Multithreading wooo!!
-            threads.push_back(thread(hillClimb, ref(newHubs[k]),search,places,ref(changing),minMax));
-        }
-        for(auto& th : threads){
-            th.join();
-        }
-        threads.clear();
+//AVX-512 version, 8 candidates per instruction
+__attribute__((target("avx512f")))
+void batchAVX512(const double *cx, const double *cy, const double *cz, int count, const placeTable &places, int begin, int end, double *out){
+    const vector<double> &coefs = asinCoefs();
+    const __m512d half = _mm512_set1_pd(0.5);
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d two = _mm512_set1_pd(2.0);
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d direct = _mm512_set1_pd(asinDirect);
+    __m512d cf[asinTerms];
+    for(int k = 0; k < asinTerms; k++){
+        cf[k] = _mm512_set1_pd(coefs[k]);
     }
+    __m512d px, py, pz, w, dx, dy, dz, h, t, p, scale;
+    for(int i = begin; i < end; i++){
+        px = _mm512_set1_pd(places.x[i]);
+        py = _mm512_set1_pd(places.y[i]);
+        pz = _mm512_set1_pd(places.z[i]);
+        w = _mm512_set1_pd(2*R*places.pop[i]);
+        for(int c = 0; c < count; c += 8){
+            dx = _mm512_sub_pd(_mm512_loadu_pd(cx+c), px);
+            dy = _mm512_sub_pd(_mm512_loadu_pd(cy+c), py);
+            dz = _mm512_sub_pd(_mm512_loadu_pd(cz+c), pz);
+            h = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dz, dz)));
+            h = _mm512_min_pd(_mm512_mul_pd(_mm512_sqrt_pd(h), half), one);
+            scale = w;
+            //Halving the angle twice if any lane is too far for the series
+            if(_mm512_cmp_pd_mask(h, direct, _CMP_GT_OQ)){
+                for(int k = 0; k < 2; k++){
+                    h = _mm512_div_pd(h, _mm512_sqrt_pd(_mm512_mul_pd(two, _mm512_add_pd(one, _mm512_sqrt_pd(_mm512_fnmadd_pd(h, h, one))))));
+                }
+                scale = _mm512_mul_pd(w, four);
+            }
+            t = _mm512_mul_pd(h, h);
+            p = cf[asinTerms-1];
+            for(int k = asinTerms-2; k >= 0; k--){
+                p = _mm512_fmadd_pd(p, t, cf[k]);
+            }
+            _mm512_storeu_pd(out+c, _mm512_fmadd_pd(scale, _mm512_mul_pd(h, p), _mm512_loadu_pd(out+c)));
+        }
+    }
+}
+#endif
+
+//Choosing the widest kernel the CPU supports (once)
+typedef void (*batchKernel)(const double *, const double *, const double *, int, const placeTable &, int, int, double *);
+batchKernel chooseKernel(){
+    batchKernel kernel = batchScalar;
+#ifdef LH_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")){
+        kernel = batchAVX512;
+    }else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        kernel = batchAVX2;
+    }
+#endif
+    return kernel;
+}
+batchKernel getKernel(){
+    static const batchKernel kernel = chooseKernel();
+    return kernel;
+}
+
+//Finding the fitness of every candidate in a batch at once
+vector<double> batchFitness(const candidates &batch, const placeTable &places){
+    int count = (int)batch.x.size();
+    //Padding up to a whole number of vectors with copies of the first candidate
+    int padded = ((count + batchPad - 1)/batchPad)*batchPad;
+    vector<double> cx(batch.x), cy(batch.y), cz(batch.z);
+    cx.resize(padded, count > 0 ? batch.x[0] : 1);
+    cy.resize(padded, count > 0 ? batch.y[0] : 0);
+    cz.resize(padded, count > 0 ? batch.z[0] : 0);
+    vector<double> fitness(padded, 0.0);
+    int n = (int)places.x.size();
+    batchKernel kernel = getKernel();
+    countDistances((long long)count*n);
+    if(n <= batchChunk){
+        kernel(cx.data(), cy.data(), cz.data(), padded, places, 0, n, fitness.data());
+    }else{
+        //Big place sets are split into chunks on the pool, partial sums are added in chunk order
+        int chunks = (n + batchChunk - 1)/batchChunk;
+        vector< vector<double> > partial(chunks, vector<double>(padded, 0.0));
+        taskGroup group;
+        for(int c = 0; c < chunks; c++){
+            pool().submit(group, [&, c](){
+                kernel(cx.data(), cy.data(), cz.data(), padded, places, c*batchChunk, min(n, (c + 1)*batchChunk), partial[c].data());
+            });
+        }
+        pool().wait(group);
+        for(int c = 0; c < chunks; c++){
+            for(int k = 0; k < padded; k++){
+                fitness[k] += partial[c][k];
+            }
+        }
+    }
+    fitness.resize(count);
+    return fitness;
+}
+
+/*
+ Approximate kernels
+ Optional (--approx) for the hill climb's comparisons, where only the order
+ of the candidates matters. Places and candidates are moved into a frame
+ centred on the stencil, so the float32 differences stay small and lose
+ only a few centimetres, and asin uses the first approxTerms terms of the
+ series (the same halving applies past asinDirect). Each distance is then
+ good to about 1e-6 relative, and float sums are flushed into doubles every
+ approxBlock places, so whole fitnesses agree with batchFitness to about
+ 1e-6 relative. Anything the hill climb settles on is re-checked with the
+ exact kernel before it is reported.
+*/
+const int approxTerms = 6;
+const int approxPad = 16;
+const int approxBlock = 64;
+
+//Structure for places relative to a frame's centre, with 2R*population weights
+struct localFrame{
+    vector<float> x, y, z, w;
+};
+
+//Scalar fallback
+void approxScalar(const float *ox, const float *oy, const float *oz, int count, const localFrame &frame, int begin, int end, double *out){
+    vector<float> acc(count);
+    for(int block = begin; block < end; block += approxBlock){
+        fill(acc.begin(), acc.end(), 0.0f);
+        int stop = min(end, block + approxBlock);
+        for(int i = block; i < stop; i++){
+            for(int c = 0; c < count; c++){
+                float dx = ox[c]-frame.x[i];
+                float dy = oy[c]-frame.y[i];
+                float dz = oz[c]-frame.z[i];
+                float h = 0.5f*sqrt(dx*dx + dy*dy + dz*dz);
+                acc[c] += frame.w[i]*asin(h < 1 ? h : 1.0f);
+            }
+        }
+        for(int c = 0; c < count; c++){
+            out[c] += acc[c];
+        }
+    }
+}
+
+#ifdef LH_X86
+//AVX2 version, 8 candidates per instruction
+__attribute__((target("avx2,fma")))
+void approxAVX2(const float *ox, const float *oy, const float *oz, int count, const localFrame &frame, int begin, int end, double *out){
+    const vector<double> &coefs = asinCoefs();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 four = _mm256_set1_ps(4.0f);
+    const __m256 direct = _mm256_set1_ps(asinDirect);
+    __m256 cf[approxTerms];
+    for(int k = 0; k < approxTerms; k++){
+        cf[k] = _mm256_set1_ps(coefs[k]);
+    }
+    vector<float> acc(count);
+    __m256 px, py, pz, w, dx, dy, dz, h, t, p, scale;
+    for(int block = begin; block < end; block += approxBlock){
+        fill(acc.begin(), acc.end(), 0.0f);
+        int stop = min(end, block + approxBlock);
+        for(int i = block; i < stop; i++){
+            px = _mm256_set1_ps(frame.x[i]);
+            py = _mm256_set1_ps(frame.y[i]);
+            pz = _mm256_set1_ps(frame.z[i]);
+            w = _mm256_set1_ps(frame.w[i]);
+            for(int c = 0; c < count; c += 8){
+                dx = _mm256_sub_ps(_mm256_loadu_ps(ox+c), px);
+                dy = _mm256_sub_ps(_mm256_loadu_ps(oy+c), py);
+                dz = _mm256_sub_ps(_mm256_loadu_ps(oz+c), pz);
+                h = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+                h = _mm256_min_ps(_mm256_mul_ps(_mm256_sqrt_ps(h), half), one);
+                scale = w;
+                //Halving the angle twice if any lane is too far for the series
+                if(_mm256_movemask_ps(_mm256_cmp_ps(h, direct, _CMP_GT_OQ))){
+                    for(int k = 0; k < 2; k++){
+                        h = _mm256_div_ps(h, _mm256_sqrt_ps(_mm256_mul_ps(two, _mm256_add_ps(one, _mm256_sqrt_ps(_mm256_fnmadd_ps(h, h, one))))));
+                    }
+                    scale = _mm256_mul_ps(w, four);
+                }
+                t = _mm256_mul_ps(h, h);
+                p = cf[approxTerms-1];
+                for(int k = approxTerms-2; k >= 0; k--){
+                    p = _mm256_fmadd_ps(p, t, cf[k]);
+                }
+                _mm256_storeu_ps(&acc[c], _mm256_fmadd_ps(scale, _mm256_mul_ps(h, p), _mm256_loadu_ps(&acc[c])));
+            }
+        }
+        for(int c = 0; c < count; c++){
+            out[c] += acc[c];
+        }
+    }
+}
+
+//AVX-512 version, 16 candidates per instruction
+__attribute__((target("avx512f")))
+void approxAVX512(const float *ox, const float *oy, const float *oz, int count, const localFrame &frame, int begin, int end, double *out){
+    const vector<double> &coefs = asinCoefs();
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 two = _mm512_set1_ps(2.0f);
+    const __m512 four = _mm512_set1_ps(4.0f);
+    const __m512 direct = _mm512_set1_ps(asinDirect);
+    __m512 cf[approxTerms];
+    for(int k = 0; k < approxTerms; k++){
+        cf[k] = _mm512_set1_ps(coefs[k]);
+    }
+    vector<float> acc(count);
+    __m512 px, py, pz, w, dx, dy, dz, h, t, p, scale;
+    for(int block = begin; block < end; block += approxBlock){
+        fill(acc.begin(), acc.end(), 0.0f);
+        int stop = min(end, block + approxBlock);
+        for(int i = block; i < stop; i++){
+            px = _mm512_set1_ps(frame.x[i]);
+            py = _mm512_set1_ps(frame.y[i]);
+            pz = _mm512_set1_ps(frame.z[i]);
+            w = _mm512_set1_ps(frame.w[i]);
+            for(int c = 0; c < count; c += 16){
+                dx = _mm512_sub_ps(_mm512_loadu_ps(ox+c), px);
+                dy = _mm512_sub_ps(_mm512_loadu_ps(oy+c), py);
+                dz = _mm512_sub_ps(_mm512_loadu_ps(oz+c), pz);
+                h = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+                h = _mm512_min_ps(_mm512_mul_ps(_mm512_sqrt_ps(h), half), one);
+                scale = w;
+                //Halving the angle twice if any lane is too far for the series
+                if(_mm512_cmp_ps_mask(h, direct, _CMP_GT_OQ)){
+                    for(int k = 0; k < 2; k++){
+                        h = _mm512_div_ps(h, _mm512_sqrt_ps(_mm512_mul_ps(two, _mm512_add_ps(one, _mm512_sqrt_ps(_mm512_fnmadd_ps(h, h, one))))));
+                    }
+                    scale = _mm512_mul_ps(w, four);
+                }
+                t = _mm512_mul_ps(h, h);
+                p = cf[approxTerms-1];
+                for(int k = approxTerms-2; k >= 0; k--){
+                    p = _mm512_fmadd_ps(p, t, cf[k]);
+                }
+                _mm512_storeu_ps(&acc[c], _mm512_fmadd_ps(scale, _mm512_mul_ps(h, p), _mm512_loadu_ps(&acc[c])));
+            }
+        }
+        for(int c = 0; c < count; c++){
+            out[c] += acc[c];
+        }
+    }
+}
+#endif
+
+//Choosing the widest approximate kernel the CPU supports (once)
+typedef void (*approxKernel)(const float *, const float *, const float *, int, const localFrame &, int, int, double *);
+approxKernel chooseApprox(){
+    approxKernel kernel = approxScalar;
+#ifdef LH_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")){
+        kernel = approxAVX512;
+    }else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        kernel = approxAVX2;
+    }
+#endif
+    return kernel;
+}
+approxKernel getApprox(){
+    static const approxKernel kernel = chooseApprox();
+    return kernel;
+}
+
+//Finding approximate fitnesses for a batch of candidates near (lat, lon) in degrees
+vector<double> approxFitness(const candidates &batch, const placeTable &places, double lat, double lon){
+    int count = (int)batch.x.size();
+    int n = (int)places.x.size();
+    double ex = cos(lat*convert)*cos(lon*convert);
+    double ey = cos(lat*convert)*sin(lon*convert);
+    double ez = sin(lat*convert);
+    //Candidates relative to the centre, padded with copies of the first
+    int padded = ((count + approxPad - 1)/approxPad)*approxPad;
+    vector<float> ox(padded), oy(padded), oz(padded);
+    for(int c = 0; c < padded; c++){
+        int k = c < count ? c : 0;
+        ox[c] = count > 0 ? batch.x[k] - ex : 0;
+        oy[c] = count > 0 ? batch.y[k] - ey : 0;
+        oz[c] = count > 0 ? batch.z[k] - ez : 0;
+    }
+    localFrame frame;
+    frame.x.resize(n);
+    frame.y.resize(n);
+    frame.z.resize(n);
+    frame.w.resize(n);
+    forChunks(n, [&](int c, int begin, int end){
+        for(int i = begin; i < end; i++){
+            frame.x[i] = places.x[i] - ex;
+            frame.y[i] = places.y[i] - ey;
+            frame.z[i] = places.z[i] - ez;
+            frame.w[i] = 2*R*places.pop[i];
+        }
+    });
+    approxKernel kernel = getApprox();
+    countDistances((long long)count*n);
+    //Same chunks as batchFitness, partial sums added in chunk order
+    int chunks = max((n + batchChunk - 1)/batchChunk, 1);
+    vector< vector<double> > partial(chunks, vector<double>(padded, 0.0));
+    taskGroup group;
+    for(int c = 0; c < chunks; c++){
+        pool().submit(group, [&, c](){
+            kernel(ox.data(), oy.data(), oz.data(), padded, frame, c*batchChunk, min(n, (c + 1)*batchChunk), partial[c].data());
+        });
+    }
+    pool().wait(group);
+    vector<double> fitness(padded, 0.0);
+    for(int c = 0; c < chunks; c++){
+        for(int k = 0; k < padded; k++){
+            fitness[k] += partial[c][k];
+        }
+    }
+    fitness.resize(count);
+    return fitness;
+}
+
+/*
+ k-d tree
+ Nearest by chord length is nearest by great-circle distance, so the tree
+ works on plain 3D unit vectors. Ties go to the lowest id, like a linear scan.
+*/
+void buildRange(kdTree &tree, int lo, int hi){
+    if(hi - lo < 1){
+        return;
+    }
+    //Splitting along the axis with the largest spread
+    double low[3] = {INFINITY, INFINITY, INFINITY};
+    double high[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for(int i = lo; i < hi; i++){
+        for(int a = 0; a < 3; a++){
+            low[a] = min(low[a], tree.pts[3*tree.ids[i]+a]);
+            high[a] = max(high[a], tree.pts[3*tree.ids[i]+a]);
+        }
+    }
+    int ax = 0;
+    for(int a = 1; a < 3; a++){
+        if(high[a] - low[a] > high[ax] - low[ax]){
+            ax = a;
+        }
+    }
+    int mid = (lo + hi)/2;
+    const vector<double> &pts = tree.pts;
+    nth_element(tree.ids.begin() + lo, tree.ids.begin() + mid, tree.ids.begin() + hi, [&pts, ax](int a, int b){
+        return pts[3*a+ax] < pts[3*b+ax];
+    });
+    tree.axis[mid] = ax;
+    tree.alive[mid] = hi - lo;
+    buildRange(tree, lo, mid);
+    buildRange(tree, mid + 1, hi);
+}
+
+kdTree buildTree(const candidates &points){
+    kdTree tree;
+    int n = (int)points.x.size();
+    tree.axis.resize(n);
+    tree.alive.resize(n);
+    tree.dead.assign(n, 0);
+    tree.slot.resize(n);
+    for(int i = 0; i < n; i++){
+        tree.ids.push_back(i);
+        tree.pts.push_back(points.x[i]);
+        tree.pts.push_back(points.y[i]);
+        tree.pts.push_back(points.z[i]);
+    }
+    buildRange(tree, 0, n);
+    //Reordering coordinates into tree order for the searches
+    vector<double> ordered(3*n);
+    for(int i = 0; i < n; i++){
+        for(int a = 0; a < 3; a++){
+            ordered[3*i+a] = tree.pts[3*tree.ids[i]+a];
+        }
+    }
+    tree.pts = ordered;
+    for(int i = 0; i < n; i++){
+        tree.slot[tree.ids[i]] = i;
+    }
+    return tree;
+}
+
+void searchRange(const kdTree &tree, int lo, int hi, const double *p, int &best, double &bestD, int &visited){
+    if(hi - lo < 1){
+        return;
+    }
+    visited++;
+    int mid = (lo + hi)/2;
+    const double *q = &tree.pts[3*mid];
+    double d = (p[0]-q[0])*(p[0]-q[0]) + (p[1]-q[1])*(p[1]-q[1]) + (p[2]-q[2])*(p[2]-q[2]);
+    if(d < bestD || (d == bestD && tree.ids[mid] < best)){
+        bestD = d;
+        best = tree.ids[mid];
+    }
+    double diff = p[tree.axis[mid]] - q[tree.axis[mid]];
+    if(diff < 0){
+        searchRange(tree, lo, mid, p, best, bestD, visited);
+        if(diff*diff <= bestD){
+            searchRange(tree, mid + 1, hi, p, best, bestD, visited);
+        }
+    }else{
+        searchRange(tree, mid + 1, hi, p, best, bestD, visited);
+        if(diff*diff <= bestD){
+            searchRange(tree, lo, mid, p, best, bestD, visited);
+        }
+    }
+}
+
+//Finding the id of the nearest point to (x, y, z), counting the points looked at
+int nearest(const kdTree &tree, double x, double y, double z, int &visited){
+    double p[3] = {x, y, z};
+    int best = -1;
+    double bestD = INFINITY;
+    searchRange(tree, 0, (int)tree.ids.size(), p, best, bestD, visited);
+    return best;
+}
+
+//Taking a point out of the tree
+void removePoint(kdTree &tree, int id){
+    int target = tree.slot[id];
+    int lo = 0;
+    int hi = (int)tree.ids.size();
+    while(hi > lo){
+        int mid = (lo + hi)/2;
+        tree.alive[mid]--;
+        if(mid == target){
+            tree.dead[mid] = 1;
+            return;
+        }
+        if(target < mid){
+            hi = mid;
+        }else{
+            lo = mid + 1;
+        }
+    }
+}
+
+//As searchRange, skipping removed points and emptied ranges
+void searchAlive(const kdTree &tree, int lo, int hi, const double *p, int &best, double &bestD){
+    if(hi - lo < 1){
+        return;
+    }
+    int mid = (lo + hi)/2;
+    if(tree.alive[mid] == 0){
+        return;
+    }
+    const double *q = &tree.pts[3*mid];
+    if(!tree.dead[mid]){
+        double d = (p[0]-q[0])*(p[0]-q[0]) + (p[1]-q[1])*(p[1]-q[1]) + (p[2]-q[2])*(p[2]-q[2]);
+        if(d < bestD || (d == bestD && tree.ids[mid] < best)){
+            bestD = d;
+            best = tree.ids[mid];
+        }
+    }
+    double diff = p[tree.axis[mid]] - q[tree.axis[mid]];
+    if(diff < 0){
+        searchAlive(tree, lo, mid, p, best, bestD);
+        if(diff*diff <= bestD){
+            searchAlive(tree, mid + 1, hi, p, best, bestD);
+        }
+    }else{
+        searchAlive(tree, mid + 1, hi, p, best, bestD);
+        if(diff*diff <= bestD){
+            searchAlive(tree, lo, mid, p, best, bestD);
+        }
+    }
+}
+
+//Finding the nearest point still in the tree, -1 once it is empty
+int nearestAlive(const kdTree &tree, double x, double y, double z){
+    double p[3] = {x, y, z};
+    int best = -1;
+    double bestD = INFINITY;
+    searchAlive(tree, 0, (int)tree.ids.size(), p, best, bestD);
+    return best;
+}
+
+//Collecting the k nearest points in a max-heap of (chord^2, id)
+void searchKnn(const kdTree &tree, int lo, int hi, const double *p, int k, int skip, vector< pair<double, int> > &heap){
+    if(hi - lo < 1){
+        return;
+    }
+    int mid = (lo + hi)/2;
+    const double *q = &tree.pts[3*mid];
+    if(tree.ids[mid] != skip){
+        double d = (p[0]-q[0])*(p[0]-q[0]) + (p[1]-q[1])*(p[1]-q[1]) + (p[2]-q[2])*(p[2]-q[2]);
+        if(heap.size() < k){
+            heap.push_back(make_pair(d, tree.ids[mid]));
+            push_heap(heap.begin(), heap.end());
+        }else if(d < heap.front().first){
+            pop_heap(heap.begin(), heap.end());
+            heap.back() = make_pair(d, tree.ids[mid]);
+            push_heap(heap.begin(), heap.end());
+        }
+    }
+    double diff = p[tree.axis[mid]] - q[tree.axis[mid]];
+    int nearLo = diff < 0 ? lo : mid + 1;
+    int nearHi = diff < 0 ? mid : hi;
+    searchKnn(tree, nearLo, nearHi, p, k, skip, heap);
+    if(heap.size() < k || diff*diff < heap.front().first){
+        searchKnn(tree, diff < 0 ? mid + 1 : lo, diff < 0 ? hi : mid, p, k, skip, heap);
+    }
+}
+
+//Finding the k nearest other points to point id, nearest first
+vector<int> nearestK(const kdTree &tree, const candidates &points, int id, int k){
+    double p[3] = {points.x[id], points.y[id], points.z[id]};
+    vector< pair<double, int> > heap;
+    searchKnn(tree, 0, (int)tree.ids.size(), p, k, id, heap);
+    sort_heap(heap.begin(), heap.end());
+    vector<int> output;
+    for(int i = 0; i < heap.size(); i++){
+        output.push_back(heap[i].second);
+    }
+    return output;
+}
+
+//Finding the fitness of multiple hubs, all connected to different places and those connections
+collection findDualFitnesses(const vector< hub > &dualHubs, const placeTable &places){
+    phaseTimer timer(assignPhase);
+    //setting variables
+    collection col;
+    size_t n = places.lat.size();
+    int chunks = max(chunksOf(n), 1);
+    vector<int> visited(chunks, 0);
+    vector<long long> scanned(chunks, 0);
+    vector<stableSum> partial(chunks);
+    
+    vector< int > connections(n);
+    
+    //Converting hubs once
+    vector<double> hubLat, hubLon, hubCos;
+    candidates hubVecs;
+    for(int j = 0; j < dualHubs.size(); j++){
+        hubLat.push_back(dualHubs[j].lat*convert);
+        hubLon.push_back(dualHubs[j].lon*convert);
+        hubCos.push_back(cos(hubLat[j]));
+        addCandidate(hubVecs, dualHubs[j].lat, dualHubs[j].lon);
+    }
+    //Indexing the hubs when there are enough to beat a plain scan
+    bool indexed = dualHubs.size() >= kdMinHubs;
+    kdTree tree;
+    if(indexed){
+        tree = buildTree(hubVecs);
+    }
+    //Starting the loop, a chunk of places at a time
+    forChunks(n, [&](int c, int begin, int end){
+        double bestFitness, testFitness;
+        int best = 0;
+        for(int i = begin; i < end; i++){
+            //Nearest hub straight from the tree (only meaningful for positive weights)
+            if(indexed && places.pop[i] > 0){
+                best = nearest(tree, places.x[i], places.y[i], places.z[i], visited[c]);
+                bestFitness = tDist(hubLat[best], hubLon[best], hubCos[best], places, i)*places.pop[i];
+                partial[c].add(bestFitness);
+                connections[i] = best;
+                continue;
+            }
+            //Best fitness so far is unknown
+            bestFitness = INFINITY;
+            scanned[c] += dualHubs.size();
+            //Loop through all the hubs
+            for(int j = 0; j < dualHubs.size(); j++){
+                testFitness = tDist(hubLat[j], hubLon[j], hubCos[j], places, i)*places.pop[i];
+                //Looking for best fitness
+                if(bestFitness > testFitness){
+                    //letting the program know a best fitness so far has been found
+                    bestFitness = testFitness;
+                    best = j;
+                }
+            }
+            //Adding on the best connection to the pile
+            partial[c].add(bestFitness);
+            connections[i] = best;
+        }
+    });
+    long long evaluated = indexed ? n : 0;
+    for(int c = 0; c < chunks; c++){
+        evaluated += visited[c] + scanned[c];
+    }
+    countDistances(evaluated);
+    //Outputting results
+    col.connections = connections;
+    col.fitness = sumChunks(partial);
+    return col;
+}
+
+//Slack on the bound test so rounding in the bounds can never skip a tie
+const double boundSlack = 1e-9;
+
+//As findDualFitnesses, but places whose hub can't have changed since the
+//last call (upper bound below lower bound, after widening both by how far
+//the hubs moved) keep their hub without a search
+collection boundedFitnesses(const vector< hub > &dualHubs, const placeTable &places, assignBounds &bounds){
+    phaseTimer timer(assignPhase);
+    collection col;
+    size_t n = places.lat.size();
+    int hubs = (int)dualHubs.size();
+    bool fresh = bounds.hubs.size() != hubs || bounds.connections.size() != n;
+    if(fresh){
+        bounds.connections.assign(n, 0);
+        bounds.upper.assign(n, INFINITY);
+        bounds.lower.assign(n, 0);
+    }
+    //How far each hub moved, and the furthest any other hub moved
+    vector<double> hubLat, hubLon, hubCos, moved(hubs, 0), others(hubs, 0);
+    candidates hubVecs;
+    for(int j = 0; j < hubs; j++){
+        hubLat.push_back(dualHubs[j].lat*convert);
+        hubLon.push_back(dualHubs[j].lon*convert);
+        hubCos.push_back(cos(hubLat[j]));
+        addCandidate(hubVecs, dualHubs[j].lat, dualHubs[j].lon);
+        if(!fresh){
+            moved[j] = dist(bounds.hubs[j].lat, dualHubs[j].lat, bounds.hubs[j].lon, dualHubs[j].lon, 1);
+        }
+    }
+    for(int j = 0; j < hubs; j++){
+        for(int k = 0; k < hubs; k++){
+            if(k != j){
+                others[j] = max(others[j], moved[k]);
+            }
+        }
+    }
+    bool indexed = hubs >= kdMinHubs;
+    kdTree tree;
+    if(indexed){
+        tree = buildTree(hubVecs);
+    }
+    int chunks = max(chunksOf(n), 1);
+    vector<stableSum> partial(chunks);
+    vector<long long> evaluated(chunks, 0);
+    forChunks(n, [&](int c, int begin, int end){
+        vector< pair<double, int> > heap;
+        for(int i = begin; i < end; i++){
+            int &best = bounds.connections[i];
+            double &upper = bounds.upper[i];
+            double &lower = bounds.lower[i];
+            //Unweighted places always go to hub 0, as in findDualFitnesses
+            if(places.pop[i] <= 0){
+                best = 0;
+                partial[c].add(tDist(hubLat[0], hubLon[0], hubCos[0], places, i)*places.pop[i]);
+                evaluated[c]++;
+                continue;
+            }
+            upper += moved[best];
+            lower -= others[best];
+            if(upper + boundSlack >= lower){
+                //Tightening the upper bound before searching
+                upper = tDist(hubLat[best], hubLon[best], hubCos[best], places, i);
+                evaluated[c]++;
+                if(upper + boundSlack >= lower){
+                    //Nearest two hubs, from the tree or a scan (ties to the lowest hub)
+                    int second = -1;
+                    if(indexed){
+                        double p[3] = {places.x[i], places.y[i], places.z[i]};
+                        heap.clear();
+                        searchKnn(tree, 0, hubs, p, 2, -1, heap);
+                        sort_heap(heap.begin(), heap.end());
+                        best = heap[0].second;
+                        second = heap.size() > 1 ? heap[1].second : -1;
+                        upper = tDist(hubLat[best], hubLon[best], hubCos[best], places, i);
+                        lower = second >= 0 ? tDist(hubLat[second], hubLon[second], hubCos[second], places, i) : INFINITY;
+                        evaluated[c] += 2;
+                    }else{
+                        upper = lower = INFINITY;
+                        for(int j = 0; j < hubs; j++){
+                            double d = tDist(hubLat[j], hubLon[j], hubCos[j], places, i);
+                            if(d < upper){
+                                lower = upper;
+                                upper = d;
+                                best = j;
+                            }else if(d < lower){
+                                lower = d;
+                            }
+                        }
+                        evaluated[c] += hubs;
+                    }
+                }
+            }else{
+                //Kept its hub, but the fitness needs the real distance
+                upper = tDist(hubLat[best], hubLon[best], hubCos[best], places, i);
+                evaluated[c]++;
+            }
+            partial[c].add(upper*places.pop[i]);
+        }
+    });
+    long long total = 0;
+    for(int c = 0; c < chunks; c++){
+        total += evaluated[c];
+    }
+    countDistances(total);
+    bounds.hubs = dualHubs;
+    col.connections = bounds.connections;
+    col.fitness = sumChunks(partial);
+    return col;
+}
+
+//Key of lattice point (i, j)
+inline uint64_t latticeKey(int i, int j){
+    return (uint64_t)(uint32_t)i << 32 | (uint32_t)j;
+}
+
+//Hill climb calculations, only working out stencil points the cache doesn't have
+//(approximate climbs compare against the hub's own approximate fitness and
+//leave that in startHub.fitness)
+bool hillClimb(hub &startHub, double search, const placeTable &places, int minMax, bool approx = false, latticeCache *cache = nullptr){
+    bool changing = false;
+    double currentFit, testFit;
+    int di = 0;
+    int dj = 0;
+    latticeCache fresh;
+    if(cache == nullptr){
+        cache = &fresh;
+    }
+    //Starting a new lattice at the hub if it isn't on the cached one
+    double ri = cache->step == search ? (startHub.lat - cache->lat)/search : 0;
+    double rj = cache->step == search ? (startHub.lon - cache->lon)/search : 0;
+    int ci = (int)lround(ri);
+    int cj = (int)lround(rj);
+    if(cache->step != search || fabs(ri) > 1e9 || fabs(rj) > 1e9 || fabs(ri - ci) > 1e-6 || fabs(rj - cj) > 1e-6){
+        cache->lat = startHub.lat;
+        cache->lon = startHub.lon;
+        cache->step = search;
+        cache->fits.clear();
+        ci = cj = 0;
+    }
+    currentFit = startHub.fitness;
+    //Building the stencil to look around (User defined) from points not seen yet
+    candidates stencil;
+    vector<uint64_t> keys;
+    for(int i = -minMax; i <= minMax; i++){
+        for(int j = -minMax; j <= minMax; j++){
+            if((i != 0 || j != 0 || approx) && cache->fits.count(latticeKey(ci + i, cj + j)) == 0){
+                addCandidate(stencil, cache->lat + (ci + i)*search, cache->lon + (cj + j)*search);
+                keys.push_back(latticeKey(ci + i, cj + j));
+            }
+        }
+    }
+    //Every new stencil fitness comes out of one pass over the places
+    if(!keys.empty()){
+        vector<double> fits = approx ? approxFitness(stencil, places, startHub.lat, startHub.lon) : batchFitness(stencil, places);
+        for(int k = 0; k < keys.size(); k++){
+            cache->fits[keys[k]] = fits[k];
+        }
+    }
+    if(cache->fits.count(latticeKey(ci, cj)) != 0){
+        currentFit = cache->fits[latticeKey(ci, cj)];
+    }
+    for(int i = -minMax; i <= minMax; i++){
+        for(int j = -minMax; j <= minMax; j++){
+            if(i != 0 || j != 0){
+                testFit = cache->fits[latticeKey(ci + i, cj + j)];
+                //Seeing if found a better fit
+                if(testFit < currentFit){
+                    changing=true;
+                    di = i;
+                    dj = j;
+                    currentFit = testFit;
+                }
+            }
+        }
+    }
+    //Editing hub
+    if(changing){
+        startHub.lat = cache->lat + (ci + di)*search;
+        startHub.lon = cache->lon + (cj + dj)*search;
+    }
+    startHub.fitness=currentFit;
+    return changing;
+}
+
+//Weiszfeld iteration for a single hub, returns the number of iterations
+int weiszfeldHub(hub &startHub, const placeTable &places, double tolerance, long long deadline = 0){
+    //Current hub as a unit vector
+    double la = startHub.lat*convert;
+    double lo = startHub.lon*convert;
+    double hx = cos(la)*cos(lo);
+    double hy = cos(la)*sin(lo);
+    double hz = sin(la);
+    double norm, step;
+    double sumX, sumY, sumZ, fitness, lastFitness = INFINITY;
+    //Fitness and pull of each chunk of places
+    int chunks = max(chunksOf(places.x.size()), 1);
+    vector<stableSum> partial(4*chunks);
+    double lastX = hx, lastY = hy, lastZ = hz;
+    int iterations = 0;
+    const int maxIterations = 1000;
+    
+    while(iterations < maxIterations && (deadline == 0 || wallNs() < deadline)){
+        iterations++;
+        //One pass gives the current fitness and the next Weiszfeld point
+        countDistances(places.x.size());
+        forChunks(places.x.size(), [&](int c, int begin, int end){
+            double cx, cy, cz, sinD, angle;
+            stableSum &f = partial[4*c], &sx = partial[4*c + 1], &sy = partial[4*c + 2], &sz = partial[4*c + 3];
+            f = sx = sy = sz = stableSum();
+            for(int i = begin; i < end; i++){
+                cx = places.y[i]*hz - places.z[i]*hy;
+                cy = places.z[i]*hx - places.x[i]*hz;
+                cz = places.x[i]*hy - places.y[i]*hx;
+                sinD = sqrt(cx*cx + cy*cy + cz*cz);
+                angle = atan2(sinD, places.x[i]*hx + places.y[i]*hy + places.z[i]*hz);
+                f.add(R*angle*places.pop[i]);
+                //Sitting on a place, which then can't pull the hub
+                if(sinD > 1e-15){
+                    sx.add(places.pop[i]*places.x[i]/sinD);
+                    sy.add(places.pop[i]*places.y[i]/sinD);
+                    sz.add(places.pop[i]*places.z[i]/sinD);
+                }
+            }
+        });
+        stableSum totals[4];
+        for(int c = 0; c < chunks; c++){
+            for(int k = 0; k < 4; k++){
+                totals[k].add(partial[4*c + k].total());
+            }
+        }
+        fitness = totals[0].total();
+        sumX = totals[1].total();
+        sumY = totals[2].total();
+        sumZ = totals[3].total();
+        //Went uphill, so go back halfway along the last step
+        if(fitness > lastFitness){
+            hx = (hx + lastX)/2;
+            hy = (hy + lastY)/2;
+            hz = (hz + lastZ)/2;
+            norm = sqrt(hx*hx + hy*hy + hz*hz);
+            hx /= norm;
+            hy /= norm;
+            hz /= norm;
+            continue;
+        }
+        lastFitness = fitness;
+        norm = sqrt(sumX*sumX + sumY*sumY + sumZ*sumZ);
+        if(norm == 0){
+            break;
+        }
+        lastX = hx;
+        lastY = hy;
+        lastZ = hz;
+        hx = sumX/norm;
+        hy = sumY/norm;
+        hz = sumZ/norm;
+        //Converged once the step is below tolerance (radians)
+        step = sqrt((hx-lastX)*(hx-lastX) + (hy-lastY)*(hy-lastY) + (hz-lastZ)*(hz-lastZ));
+        if(step < tolerance){
+            break;
+        }
+    }
+    //Editing hub
+    startHub.lat = atan2(hz, sqrt(hx*hx + hy*hy))/convert;
+    startHub.lon = atan2(hy, hx)/convert;
+    startHub.fitness = findFitness(startHub.lat, startHub.lon, places);
+    return iterations;
+}
+
+/*
+ Anytime solving
+ With a budget everything stops at the deadline: no restart starts after
+ it, and optimise and multiBALL stop at their next pass, returning the best
+ hubs found. Improving results are checkpointed (hubs and assignments, as
+ text) at most every snapshotEvery seconds, by a saver thread that catches
+ improvements nothing came after, and once more at the end. A checkpoint
+ can seed the first restart of a later run.
+*/
+const double snapshotEvery = 1.0;
+
+struct anytime{
+    mutex lock;
+    string file;
+    double fitness = INFINITY;
+    vector<hub> hubs;
+    vector<int> connections;
+    bool unsaved = false;
+    long long saved = 0;
+    //Set (and tick notified) to stop the saver thread
+    bool finished = false;
+    condition_variable tick;
+};
+
+bool pastDeadline(const settings &opts){
+    return opts.deadline != 0 && wallNs() >= opts.deadline;
+}
+
+//Writing a checkpoint (to a temporary file first, so a kill never leaves half of one)
+//(anything in extra goes after, where readCheckpoint doesn't look)
+void writeCheckpoint(string fileName, double fitness, const vector<hub> &hubs, const vector<int> &connections, const string &extra = ""){
+    string temporary = fileName + ".tmp";
+    ofstream file(temporary);
+    if(!file.is_open()){
+        cerr << temporary << " couldn't be written!\n";
+        return;
+    }
+    file << setprecision(17) << "LogisticsHub checkpoint\nfitness " << fitness << "\nhubs " << hubs.size() << "\n";
+    for(int i = 0; i < hubs.size(); i++){
+        file << hubs[i].lat << " " << hubs[i].lon << "\n";
+    }
+    file << "connections " << connections.size() << "\n";
+    for(int i = 0; i < connections.size(); i++){
+        file << connections[i] << (i + 1 < connections.size() ? " " : "\n");
+    }
+    file << extra;
+    file.close();
+    rename(temporary.c_str(), fileName.c_str());
+}
+
+//Reading a checkpoint back, false if it's missing or doesn't fit places
+bool readCheckpoint(string fileName, const placeTable &places, vector<hub> &hubs, vector<int> &connections){
+    ifstream file(fileName);
+    string word;
+    double fitness;
+    size_t count;
+    if(!getline(file, word) || word != "LogisticsHub checkpoint" || !(file >> word >> fitness >> word >> count) || count < 1){
+        return false;
+    }
+    hubs.assign(count, hub());
+    for(size_t i = 0; i < count; i++){
+        if(!(file >> hubs[i].lat >> hubs[i].lon)){
+            return false;
+        }
+        hubs[i].servicing = 0;
+    }
+    if(!(file >> word >> count) || count != places.lat.size()){
+        return false;
+    }
+    connections.assign(count, 0);
+    for(size_t i = 0; i < count; i++){
+        if(!(file >> connections[i]) || connections[i] < 0 || connections[i] >= hubs.size()){
+            return false;
+        }
+    }
+    return true;
+}
+
+//Saving the checkpoint every snapshotEvery seconds while it has unsaved improvements, until finished
+void saveSnapshots(anytime &best){
+    unique_lock<mutex> guard(best.lock);
+    while(!best.finished){
+        best.tick.wait_for(guard, chrono::duration<double>(snapshotEvery));
+        if(best.unsaved && wallNs() - best.saved >= snapshotEvery*1e9){
+            writeCheckpoint(best.file, best.fitness, best.hubs, best.connections);
+            best.unsaved = false;
+            best.saved = wallNs();
+        }
+    }
+}
+
+//Starting the saver thread for a run's checkpoint, if it has one
+thread startSaving(anytime &progress){
+    return progress.file.empty() ? thread() : thread(saveSnapshots, ref(progress));
+}
+
+//Stopping the saver thread and writing whatever it hadn't yet
+void finishSaving(anytime &progress, thread &saver){
+    if(saver.joinable()){
+        {
+            lock_guard<mutex> guard(progress.lock);
+            progress.finished = true;
+        }
+        progress.tick.notify_all();
+        saver.join();
+    }
+    if(progress.unsaved && !progress.file.empty()){
+        writeCheckpoint(progress.file, progress.fitness, progress.hubs, progress.connections);
+    }
+}
+
+//Offering a result to the run's checkpoint
+void offerSnapshot(const settings &opts, const vector<hub> &hubs, const collection &standing){
+    if(opts.progress == nullptr){
+        return;
+    }
+    anytime &best = *opts.progress;
+    lock_guard<mutex> guard(best.lock);
+    if(standing.fitness >= best.fitness){
+        return;
+    }
+    best.fitness = standing.fitness;
+    best.hubs = hubs;
+    best.connections = standing.connections;
+    best.unsaved = true;
+    if(!best.file.empty() && wallNs() - best.saved >= snapshotEvery*1e9){
+        writeCheckpoint(best.file, best.fitness, best.hubs, best.connections);
+        best.unsaved = false;
+        best.saved = wallNs();
+    }
+}
+
+/*
+ Coarse-to-fine
+ Far from its optimum a hub's direction doesn't depend on fine detail, so
+ the first passes can run on places merged into population-weighted grid
+ cells. Each level halves the step and the cells, and the last pass always
+ runs on every place at the requested step, so the answer is still a local
+ optimum of the full data.
+*/
+//Coarsest level runs at 2^coarseLevels times the requested step
+const int coarseLevels = 6;
+//Largest step (degrees) worth starting from
+const double coarseMaxStep = 0.5;
+//Grid cells are this many steps across
+const double coarseCell = 2;
+//Smaller place sets go straight to the full data
+const int coarseMinPlaces = 4096;
+
+//Merging places into lat/long grid cells, each at its population-weighted
+//centre with the summed population (empty cells add nothing so are dropped)
+placeTable coarsen(const placeTable &places, double cell){
+    size_t n = places.x.size();
+    vector< pair<long long, int> > cells(n);
+    for(size_t i = 0; i < n; i++){
+        long long row = (long long)floor(places.lat[i]/convert/cell);
+        long long col = (long long)floor(places.lon[i]/convert/cell);
+        cells[i] = make_pair(row*4000000 + col, (int)i);
+    }
+    sort(cells.begin(), cells.end());
+    vector<double> sumX, sumY, sumZ, sumPop;
+    for(size_t i = 0; i < n; i++){
+        int k = cells[i].second;
+        if(i == 0 || cells[i].first != cells[i-1].first){
+            sumX.push_back(0);
+            sumY.push_back(0);
+            sumZ.push_back(0);
+            sumPop.push_back(0);
+        }
+        sumX.back() += places.pop[k]*places.x[k];
+        sumY.back() += places.pop[k]*places.y[k];
+        sumZ.back() += places.pop[k]*places.z[k];
+        sumPop.back() += places.pop[k];
+    }
+    vector<int> kept;
+    for(int c = 0; c < sumPop.size(); c++){
+        double norm = sqrt(sumX[c]*sumX[c] + sumY[c]*sumY[c] + sumZ[c]*sumZ[c]);
+        if(sumPop[c] > 0 && norm > 0){
+            kept.push_back(c);
+        }
+    }
+    placeTable output;
+    double *base = allocTable(output, kept.size());
+    for(size_t i = 0; i < kept.size(); i++){
+        int c = kept[i];
+        double norm = sqrt(sumX[c]*sumX[c] + sumY[c]*sumY[c] + sumZ[c]*sumZ[c]);
+        double lat = asin(max(-1.0, min(1.0, sumZ[c]/norm)))/convert;
+        double lon = atan2(sumY[c], sumX[c])/convert;
+        setPlace(base, kept.size(), i, lat, lon, sumPop[c]);
+    }
+    return output;
+}
+
+opInfo optimise(vector< hub > hubs, const placeTable &places, const settings &opts, latticeCache *cache = nullptr);
+
+//Running the coarse levels from coarsest to finest, returns the iterations
+//taken (hubs come back with their fitness over the full places)
+int coarsePasses(vector< hub > &hubs, const placeTable &places, const settings &opts){
+    int levels = 0;
+    while(levels < coarseLevels && opts.search*(2 << levels) <= coarseMaxStep){
+        levels++;
+    }
+    int iterations = 0;
+    settings level = opts;
+    level.coarse = false;
+    for(int l = levels; l >= 1; l--){
+        level.search = opts.search*(1 << l);
+        placeTable merged = coarsen(places, level.search*coarseCell);
+        //Not worth it once cells stop halving the work
+        if(2*merged.x.size() > places.x.size()){
+            break;
+        }
+        for(int k = 0; k < hubs.size(); k++){
+            hubs[k].fitness = findFitness(hubs[k].lat, hubs[k].lon, merged);
+        }
+        opInfo pass = optimise(hubs, merged, level);
+        hubs = pass.finals;
+        iterations += pass.iterations;
+    }
+    for(int k = 0; k < hubs.size(); k++){
+        hubs[k].fitness = findFitness(hubs[k].lat, hubs[k].lon, places);
+    }
+    return iterations;
+}
+
+//Optimising for _____single______ hub, carrying on from the fitnesses in
+//cache if they came from these places
+opInfo optimise(vector< hub > hubs, const placeTable &places, const settings &opts, latticeCache *cache){
+    phaseTimer timer(optimisePhase);
+    opInfo output;
+    vector< hub > newHubs = hubs;
+    double search = opts.search;
+    int minMax = opts.minMax;
+    
+    //Relocating hubs
+    bool changing = true;
+    int iterations = 0;
+    int coarseIterations = 0;
+    if(opts.coarse && places.x.size() >= coarseMinPlaces){
+        coarseIterations = coarsePasses(newHubs, places, opts);
+    }
+    
+    //Weiszfeld converges on its own, to a tenth of the search step
+    if(opts.mode == weiszfeld){
+        for(int k = 0; k < newHubs.size(); k++){
+            iterations = max(iterations, weiszfeldHub(newHubs[k], places, search*convert/10, opts.deadline));
+        }
+        changing = false;
+    }
+    
+    //Each hub reports its own change so there is nothing shared to race on
+    vector<int> changed(newHubs.size());
+    bool approx = opts.approx;
+    //Approximate fitnesses are only kept for this climb
+    latticeCache approxLattice, exactLattice;
+    if(cache == nullptr){
+        cache = &exactLattice;
+    }
+    //Starting the loop to find local minimum(s)
+    while(changing && !pastDeadline(opts)){
+        //Seeing how many iterations it took
+        iterations++;
+        changing = false;
+        //Looping through the hubs
+        if(newHubs.size() == 1){
+            changed[0] = hillClimb(newHubs[0], search, places, minMax, approx, approx ? &approxLattice : cache);
+        }else{
+            taskGroup group;
+            for(int k = 0; k < newHubs.size(); k++){
+                pool().submit(group, [&, k](){
+                    changed[k] = hillClimb(newHubs[k], search, places, minMax, approx);
+                });
+            }
+            pool().wait(group);
+        }
+        for(int k = 0; k < newHubs.size(); k++){
+            changing = changing || changed[k];
+        }
+        //Approximate climb settled, so carrying on with exact fitnesses
+        if(!changing && approx){
+            approx = false;
+            changing = true;
+            for(int k = 0; k < newHubs.size(); k++){
+                newHubs[k].fitness = findFitness(newHubs[k].lat, newHubs[k].lon, places);
+            }
+        }
+    }
+    countOptimise(iterations);
     //Output results
-    output.iterations = iterations;
+    output.iterations = iterations + coarseIterations;
     output.finals = newHubs;
+    return output;
+}
+
+//A run is given up once this many more passes, each as good as the last,
+//still couldn't reach the incumbent (passes usually gain less each time)
+const double abandonPasses = 4;
+
+//Optimising for _____multiple______ hubs, giving up if it can't plausibly beat
+//the incumbent (the best finished restart's fitness) when one is given
+opInfo multiBALL(vector< hub > oldHubs, const placeTable &places, const settings &opts, const atomic<double> *incumbent = nullptr){
+    //Setting variables
+    opInfo output;
+    collection standing;
+    collection newStanding;
+    
+    vector<hub> hubs = oldHubs;
+    
+    int iterations = 0;
+    bool testing = true;
+    //Setting standing fitness, later assignments only search places the bounds can't settle
+    assignBounds bounds;
+    standing = boundedFitnesses(hubs, places, bounds);
+    //Hubs the standing came from
+    vector<hub> standingHubs = hubs;
+    offerSnapshot(opts, hubs, standing);
+    //Getting conenctions, making each hub optimised for the cities it is connected to
+    vector< vector<int> > ids(hubs.size());
+    for(int j = 0; j < standing.connections.size(); j++){
+        ids[standing.connections[j]].push_back(j);
+    }
+    //Hubs that moved or whose places changed (any other is already optimised for its places)
+    vector<char> dirty(hubs.size(), 1);
+    //Stencil fitnesses each hub has found over its current places
+    vector<latticeCache> lattices(hubs.size());
+    //Only the first pass starts far enough out to gain from coarse levels
+    settings pass = opts;
+    //Staring loop
+    while(testing) {
+        testing = false;
+        iterations++;
+        //Looping through each hub, as tasks on the pool
+        taskGroup group;
+        for(int i = 0; i < hubs.size(); i++){
+            if(!dirty[i]){
+                continue;
+            }
+            pool().submit(group, [&, i](){
+                placeTable subPlaces = subView(places, ids[i]);
+                //Optimising each hub
+                vector<hub> testHubs(1, hubs[i]);
+                hubs[i] = optimise(testHubs, subPlaces, pass, &lattices[i]).finals[0];
+                dirty[i] = hubs[i].lat != testHubs[0].lat || hubs[i].lon != testHubs[0].lon;
+            });
+        }
+        pool().wait(group);
+        pass.coarse = false;
+        //Making a new standing
+        newStanding = boundedFitnesses(hubs, places, bounds);
+        //Checking to see if new fitness is better than the old one
+        if(newStanding.fitness<standing.fitness){
+            testing = true;
+            double gain = standing.fitness - newStanding.fitness;
+            //Moving places that changed hub between the lists (kept in place order)
+            vector< vector<int> > leaving(hubs.size()), arriving(hubs.size());
+            for(int j = 0; j < newStanding.connections.size(); j++){
+                if(newStanding.connections[j] != standing.connections[j]){
+                    leaving[standing.connections[j]].push_back(j);
+                    arriving[newStanding.connections[j]].push_back(j);
+                }
+            }
+            for(int i = 0; i < hubs.size(); i++){
+                if(!leaving[i].empty() || !arriving[i].empty()){
+                    dirty[i] = 1;
+                    lattices[i].fits.clear();
+                    vector<int> kept, merged;
+                    set_difference(ids[i].begin(), ids[i].end(), leaving[i].begin(), leaving[i].end(), back_inserter(kept));
+                    merge(kept.begin(), kept.end(), arriving[i].begin(), arriving[i].end(), back_inserter(merged));
+                    ids[i].swap(merged);
+                }
+            }
+            standing = newStanding;
+            standingHubs = hubs;
+            offerSnapshot(opts, hubs, standing);
+            if(incumbent != nullptr && standing.fitness - abandonPasses*gain > incumbent->load()){
+                output.abandoned = 1;
+                break;
+            }
+        }
+        //Out of time, so the hubs that gave the standing are the answer
+        if(pastDeadline(opts)){
+            hubs = standingHubs;
+            break;
+        }
+    }
+    
+    countMulti(iterations);
+    output.iterations=iterations;
+    output.finals=hubs;
+    output.addon=standing;
+    return output;
+}
+
+/*
+ Discrete sites
+ With a cost matrix, hubs can only sit on its candidate sites. Places go to
+ the hub site that costs them least, then each hub in turn moves to
+ whichever of the siteNeighbours sites nearest it or nearest the middle of
+ its places (not taken by another hub) serves them most cheaply, until the
+ total stops falling.
+*/
+const int siteNeighbours = 32;
+
+//Writing great-circle costs between every pair of places as a square
+//matrix (a template for offline tools, and for testing)
+void writeCosts(const placeTable &places, string fileName){
+    size_t n = places.lat.size();
+    costHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, costMagic, sizeof(header.magic));
+    header.places = n;
+    header.sites = n;
+    header.square = 1;
+    ofstream file(fileName, ios::binary);
+    if(!file.is_open()){
+        cout << fileName << " couldn't be written!" << "\n";
+        exit(1);
+    }
+    file.write((const char *)&header, sizeof(header));
+    vector<double> coords(n);
+    for(size_t i = 0; i < n; i++){
+        coords[i] = places.lat[i]/convert;
+    }
+    file.write((const char *)coords.data(), n*sizeof(double));
+    for(size_t i = 0; i < n; i++){
+        coords[i] = places.lon[i]/convert;
+    }
+    file.write((const char *)coords.data(), n*sizeof(double));
+    vector<float> column(n);
+    for(size_t s = 0; s < n; s++){
+        for(size_t i = 0; i < n; i++){
+            column[i] = (float)tDist(places.lat[s], places.lon[s], places.cosLat[s], places, i);
+        }
+        file.write((const char *)column.data(), n*sizeof(float));
+    }
+    file.close();
+    cout << "Wrote costs between " << n << " places to " << fileName << "\n";
+}
+
+//Assigning places to hub sites by cost (ties to the lowest hub), a block of
+//rows from each hub's column at a time
+collection siteFitnesses(const vector<int> &hubSites, const placeTable &places, const costMatrix &costs){
+    phaseTimer timer(assignPhase);
+    collection col;
+    size_t n = places.lat.size();
+    col.connections.assign(n, 0);
+    int chunks = max(chunksOf(n), 1);
+    vector<stableSum> partial(chunks);
+    forChunks(n, [&](int c, int begin, int end){
+        vector<float> best(end - begin, INFINITY);
+        for(int j = 0; j < hubSites.size(); j++){
+            const float *column = costs.column(hubSites[j]);
+            for(int i = begin; i < end; i++){
+                float cost = column[placeRow(places, i)];
+                if(cost < best[i - begin]){
+                    best[i - begin] = cost;
+                    col.connections[i] = j;
+                }
+            }
+        }
+        for(int i = begin; i < end; i++){
+            if(places.pop[i] != 0){
+                partial[c].add(best[i - begin]*places.pop[i]);
+            }
+        }
+    });
+    countDistances((long long)n*hubSites.size());
+    col.fitness = sumChunks(partial);
+    return col;
+}
+
+//Cost of serving some places (in row order) from a site
+double siteCost(int site, const vector<int> &ids, const placeTable &places, const costMatrix &costs){
+    const float *column = costs.column(site);
+    stableSum total;
+    for(int k = 0; k < ids.size(); k++){
+        if(places.pop[ids[k]] != 0){
+            total.add(column[placeRow(places, ids[k])]*places.pop[ids[k]]);
+        }
+    }
+    countDistances(ids.size());
+    return total.total();
+}
+
+//Sites nearest a position (degrees), nearest first
+vector<int> nearSites(const kdTree &tree, double lat, double lon, int k){
+    candidates point;
+    addCandidate(point, lat, lon);
+    double p[3] = {point.x[0], point.y[0], point.z[0]};
+    vector< pair<double, int> > heap;
+    searchKnn(tree, 0, (int)tree.ids.size(), p, k, -1, heap);
+    sort_heap(heap.begin(), heap.end());
+    vector<int> output;
+    for(int i = 0; i < heap.size(); i++){
+        output.push_back(heap[i].second);
+    }
+    return output;
+}
+
+//Per hub, the places assigned to it (in row order)
+vector< vector<int> > hubPlaces(const collection &col, int hubs){
+    vector< vector<int> > ids(hubs);
+    for(int i = 0; i < col.connections.size(); i++){
+        ids[col.connections[i]].push_back(i);
+    }
+    return ids;
+}
+
+//Optimising hubs over the cost matrix's sites, starting from the nearest free site to each
+opInfo multiSites(vector< hub > oldHubs, const placeTable &places, const costMatrix &costs, const settings &opts){
+    opInfo output;
+    candidates points;
+    for(size_t s = 0; s < costs.sites; s++){
+        addCandidate(points, costs.siteLat[s], costs.siteLon[s]);
+    }
+    kdTree tree = buildTree(points);
+    int reach = (int)min((size_t)siteNeighbours, costs.sites);
+    vector<int> hubSites;
+    for(int j = 0; j < oldHubs.size(); j++){
+        vector<int> near = nearSites(tree, oldHubs[j].lat, oldHubs[j].lon, reach);
+        int pick = near[0];
+        for(int k = 0; k < near.size(); k++){
+            if(find(hubSites.begin(), hubSites.end(), near[k]) == hubSites.end()){
+                pick = near[k];
+                break;
+            }
+        }
+        hubSites.push_back(pick);
+    }
+    collection standing = siteFitnesses(hubSites, places, costs);
+    vector<hub> hubs(hubSites.size());
+    int iterations = 0;
+    bool testing = true;
+    while(testing && !pastDeadline(opts)){
+        testing = false;
+        iterations++;
+        vector< vector<int> > ids = hubPlaces(standing, (int)hubSites.size());
+        vector<int> moved = hubSites;
+        for(int j = 0; j < moved.size(); j++){
+            //Pricing the free sites near this hub and near the middle of its
+            //places (population weighted), as tasks on the pool
+            vector<int> near = nearSites(tree, costs.siteLat[moved[j]], costs.siteLon[moved[j]], reach);
+            double x = 0, y = 0, z = 0;
+            for(int k = 0; k < ids[j].size(); k++){
+                x += places.x[ids[j][k]]*places.pop[ids[j][k]];
+                y += places.y[ids[j][k]]*places.pop[ids[j][k]];
+                z += places.z[ids[j][k]]*places.pop[ids[j][k]];
+            }
+            if(x != 0 || y != 0 || z != 0){
+                vector<int> middle = nearSites(tree, atan2(z, sqrt(x*x + y*y))/convert, atan2(y, x)/convert, reach);
+                for(int k = 0; k < middle.size(); k++){
+                    if(find(near.begin(), near.end(), middle[k]) == near.end()){
+                        near.push_back(middle[k]);
+                    }
+                }
+            }
+            vector<double> price(near.size(), INFINITY);
+            taskGroup group;
+            for(int k = 0; k < near.size(); k++){
+                if(near[k] != moved[j] && find(moved.begin(), moved.end(), near[k]) != moved.end()){
+                    continue;
+                }
+                pool().submit(group, [&, k](){
+                    price[k] = siteCost(near[k], ids[j], places, costs);
+                });
+            }
+            pool().wait(group);
+            double current = price[find(near.begin(), near.end(), moved[j]) - near.begin()];
+            int best = (int)(min_element(price.begin(), price.end()) - price.begin());
+            if(price[best] < current){
+                moved[j] = near[best];
+            }
+        }
+        collection newStanding = siteFitnesses(moved, places, costs);
+        if(newStanding.fitness < standing.fitness){
+            testing = true;
+            standing = newStanding;
+            hubSites = moved;
+            for(int j = 0; j < hubs.size(); j++){
+                hubs[j].lat = costs.siteLat[hubSites[j]];
+                hubs[j].lon = costs.siteLon[hubSites[j]];
+            }
+            offerSnapshot(opts, hubs, standing);
+        }
+    }
+    //Hubs where their sites are, with what their places cost them
+    vector< vector<int> > ids = hubPlaces(standing, (int)hubSites.size());
+    for(int j = 0; j < hubs.size(); j++){
+        hubs[j].lat = costs.siteLat[hubSites[j]];
+        hubs[j].lon = costs.siteLon[hubSites[j]];
+        hubs[j].fitness = siteCost(hubSites[j], ids[j], places, costs);
+        hubs[j].servicing = 0;
+    }
+    countMulti(iterations);
     output.iterations = iterations;
+    output.finals = hubs;
+    output.addon = standing;
+    return output;
+}
+
+//Picking k-means++ starting places: each is drawn with probability
+//proportional to population times squared distance to the nearest pick
+vector<int> kmeansPlaces(int numOfHubs, const placeTable &places, mt19937_64 &generate){
+    int n = (int)places.x.size();
+    vector<int> picks;
+    vector<double> nearest(n, INFINITY);
+    vector<double> weights(n);
+    uniform_real_distribution<> unit(0, 1);
+    double dx, dy, dz, total, target;
+    for(int k = 0; k < numOfHubs && n > 0; k++){
+        total = 0;
+        for(int i = 0; i < n; i++){
+            //First pick is just population weighted
+            weights[i] = k == 0 ? places.pop[i] : places.pop[i]*nearest[i];
+            total += weights[i];
+        }
+        int pick = 0;
+        if(total > 0){
+            target = unit(generate)*total;
+            while(pick < n - 1 && target >= weights[pick]){
+                target -= weights[pick];
+                pick++;
+            }
+        }else{
+            //Nothing left to weight, so any place will do
+            pick = uniform_int_distribution<int>(0, n - 1)(generate);
+        }
+        picks.push_back(pick);
+        countDistances(n);
+        for(int i = 0; i < n; i++){
+            dx = places.x[i] - places.x[pick];
+            dy = places.y[i] - places.y[pick];
+            dz = places.z[i] - places.z[pick];
+            nearest[i] = min(nearest[i], dx*dx + dy*dy + dz*dz);
+        }
+    }
+    return picks;
+}
+
+//Generating random hubs (reproducible for a given seed)
+vector<hub> getHubs(bounds boundaries, int numOfHubs, const placeTable &places, uint64_t seed, seeding start){
+    phaseTimer timer(seedPhase);
+    vector<hub> hubs;
+    //Using Mersenne Twister engine (64 bit unsigned)
+    mt19937_64 generate(seed);
+    uniform_real_distribution<> distLat(boundaries.minLat,boundaries.maxLat);
+    uniform_real_distribution<> distLong(boundaries.minLong,boundaries.maxLong);
+    vector<int> picks;
+    if(start == kmeansSeeding){
+        picks = kmeansPlaces(numOfHubs, places, generate);
+    }
+    hub alpha;
+    //Setting random hubs
+    for(int i = 0; i < numOfHubs; i++){
+        if(i < picks.size()){
+            alpha.lat = places.lat[picks[i]]/convert;
+            alpha.lon = places.lon[picks[i]]/convert;
+        }else{
+            alpha.lat = distLat(generate);
+            alpha.lon = distLong(generate);
+        }
+        alpha.fitness = findFitness(alpha.lat, alpha.lon, places);
+        alpha.servicing = 0;
+        hubs.push_back(alpha);
+    }
+    return hubs;
+}
+
+//Seed for restart i (other streams give tempering draws of its own)
+uint64_t restartSeed(const settings &opts, int i, uint32_t stream = 0){
+    vector<uint32_t> key = {(uint32_t)opts.seed, (uint32_t)(opts.seed >> 32), (uint32_t)i};
+    if(stream != 0){
+        key.push_back(stream);
+    }
+    seed_seq sequence(key.begin(), key.end());
+    uint32_t words[2];
+    sequence.generate(words, words + 2);
+    return ((uint64_t)words[0] << 32) | words[1];
+}
+
+//Local search from some hubs, over the cost matrix's sites if there is one
+opInfo descend(const vector< hub > &hubs, const placeTable &places, const settings &opts, const atomic<double> *incumbent = nullptr){
+    return opts.costs != nullptr ? multiSites(hubs, places, *opts.costs, opts) : multiBALL(hubs, places, opts, incumbent);
+}
+
+//Calculating possibilities concurrently (each restart writes only its own result)
+void possible(int i, bounds boundaries, int nums, const placeTable &places, opInfo &data, settings opts, const vector<hub> *resumed = nullptr, const atomic<double> *incumbent = nullptr){
+    vector<hub> hubsA;
+    opInfo moreData;
+    if(opts.verbose){
+        cout << "Starting restart " << i << "\n";
+    }
+    countRestart();
+    //Getting hubs and data for hubs (includes optimisation), the first restart
+    //can carry on from a checkpoint
+    if(i == 0 && resumed != nullptr){
+        hubsA = *resumed;
+        for(int k = 0; k < hubsA.size(); k++){
+            hubsA[k].fitness = findFitness(hubsA[k].lat, hubsA[k].lon, places);
+        }
+        if(opts.verbose){
+            cout << "Restart 0 resumed from " << opts.resume << "\n";
+        }
+    }else{
+        hubsA = getHubs(boundaries, nums, places, restartSeed(opts, i), opts.start);
+    }
+    moreData = descend(hubsA, places, opts, incumbent);
+    //Outputting results
+    hubsA = moreData.finals;
+    if(moreData.abandoned){
+        countAbandoned();
+        if(opts.verbose){
+            cout << "Restart " << i << " abandoned at node length " << moreData.addon.fitness << "\n";
+        }
+    }else if(opts.verbose){
+        cout << "Restart " << i << " has node length " << moreData.addon.fitness <<"\n";
+    }
+    data = moreData;
+    data.restart = i;
+}
+
+void pickSeed(settings &opts){
+    if(!opts.seeded){
+        random_device random;
+        opts.seed = ((uint64_t)random() << 32) | random();
+        opts.seeded = true;
+    }
+}
+
+/*
+ Tempering
+ Optional (--temper) instead of independent restarts. Chains (one per
+ thread, at least temperChains) each start from a restart and then take
+ steps: one hub is nudged, further in hotter chains, or moved to a place
+ drawn like k-means++ (population times squared distance to its hub), and
+ everything is optimised again. A step is kept by the Metropolis rule at the
+ chain's temperature, a fraction of the fitness from temperCold for the
+ coldest chain to temperHot for the hottest. Every exchangeEvery rounds
+ neighbouring chains may swap states, so good ones sink to the cold end.
+*/
+const int temperChains = 4;
+const double temperCold = 1e-4;
+const double temperHot = 1e-2;
+//Nudge (degrees) in the coldest chain, growing with the root of the temperature
+const double temperNudge = 0.05;
+const int exchangeEvery = 4;
+
+//Structure for one tempering chain
+struct chain{
+    opInfo state;
+    double temperature;
+    double nudge;
+    mt19937_64 generate;
+};
+
+//Taking one step of a chain, true if it was kept
+bool temperStep(chain &walker, const placeTable &places, const settings &opts){
+    vector<hub> trial = walker.state.finals;
+    uniform_real_distribution<> unit(0, 1);
+    int j = uniform_int_distribution<int>(0, (int)trial.size() - 1)(walker.generate);
+    if(unit(walker.generate) < 0.5){
+        normal_distribution<> nudge(0, walker.nudge);
+        trial[j].lat += nudge(walker.generate);
+        trial[j].lon += nudge(walker.generate);
+    }else{
+        //Drawing the new spot among places far from their hubs
+        const vector<int> &connections = walker.state.addon.connections;
+        int n = (int)places.x.size();
+        candidates hubs;
+        for(int k = 0; k < trial.size(); k++){
+            addCandidate(hubs, trial[k].lat, trial[k].lon);
+        }
+        vector<double> weights(n);
+        double total = 0;
+        for(int i = 0; i < n; i++){
+            int k = connections[i];
+            double dx = places.x[i] - hubs.x[k];
+            double dy = places.y[i] - hubs.y[k];
+            double dz = places.z[i] - hubs.z[k];
+            weights[i] = places.pop[i]*(dx*dx + dy*dy + dz*dz);
+            total += weights[i];
+        }
+        int pick = 0;
+        double target = unit(walker.generate)*total;
+        while(pick < n - 1 && target >= weights[pick]){
+            target -= weights[pick];
+            pick++;
+        }
+        trial[j].lat = places.lat[pick]/convert;
+        trial[j].lon = places.lon[pick]/convert;
+    }
+    trial[j].fitness = findFitness(trial[j].lat, trial[j].lon, places);
+    opInfo next = descend(trial, places, opts);
+    double change = next.addon.fitness - walker.state.addon.fitness;
+    if(change <= 0 || unit(walker.generate) < exp(-change/walker.temperature)){
+        walker.state = next;
+        return true;
+    }
+    return false;
+}
+
+//Running the chains for a number of rounds (or until the budget runs out), keeping the best state any reached
+opInfo temper(const placeTable &places, bounds boundaries, int nums, int rounds, const settings &opts, const vector<hub> *resumed = nullptr){
+    int chains = max(temperChains, pool().size());
+    vector<chain> walkers(chains);
+    taskGroup starts;
+    for(int c = 0; c < chains; c++){
+        pool().submit(starts, [&, c](){
+            possible(opts.firstRestart + c, boundaries, nums, places, walkers[c].state, opts, resumed);
+            walkers[c].generate.seed(restartSeed(opts, opts.firstRestart + c, 1));
+        });
+    }
+    pool().wait(starts);
+    int best = 0;
+    for(int c = 1; c < chains; c++){
+        if(walkers[c].state.addon.fitness < walkers[best].state.addon.fitness){
+            best = c;
+        }
+    }
+    opInfo output = walkers[best].state;
+    //Temperatures spaced evenly in log between the ends
+    double scale = output.addon.fitness;
+    for(int c = 0; c < chains; c++){
+        double ratio = pow(temperHot/temperCold, c/(chains - 1.0));
+        walkers[c].temperature = scale*temperCold*ratio;
+        walkers[c].nudge = temperNudge*sqrt(ratio);
+    }
+    mt19937_64 exchange(restartSeed(opts, opts.firstRestart, 2));
+    uniform_real_distribution<> unit(0, 1);
+    int steps = chains;
+    int kept = 0;
+    vector<int> moved(chains);
+    for(int r = 0; (opts.budget > 0 || r < rounds) && !pastDeadline(opts); r++){
+        taskGroup group;
+        for(int c = 0; c < chains; c++){
+            pool().submit(group, [&, c](){
+                moved[c] = temperStep(walkers[c], places, opts);
+            });
+        }
+        pool().wait(group);
+        //Keeping the best (the lowest chain wins a tie)
+        for(int c = 0; c < chains; c++){
+            steps++;
+            kept += moved[c];
+            if(walkers[c].state.addon.fitness < output.addon.fitness){
+                output = walkers[c].state;
+                offerSnapshot(opts, output.finals, output.addon);
+            }
+        }
+        //Swapping neighbouring chains' states
+        if((r + 1) % exchangeEvery == 0){
+            for(int c = 0; c + 1 < chains; c++){
+                double gain = (1/walkers[c].temperature - 1/walkers[c + 1].temperature)*(walkers[c].state.addon.fitness - walkers[c + 1].state.addon.fitness);
+                if(gain >= 0 || unit(exchange) < exp(gain)){
+                    swap(walkers[c].state, walkers[c + 1].state);
+                }
+            }
+        }
+    }
+    if(opts.verbose){
+        cout << "Tempering took " << steps << " steps over " << chains << " chains, " << kept << " kept\n";
+    }
+    output.restarts = steps;
+    output.abandoned = 0;
+    output.restart = -1;
+    return output;
+}
+
+//Running every restart on the pool and keeping the best
+opInfo solve(const placeTable &places, bounds boundaries, int nums, int loops, const settings &given){
+    settings opts = given;
+    anytime progress;
+    progress.file = opts.snapshot;
+    opts.progress = &progress;
+    opInfo bestData;
+    bestData.iterations = 0;
+    bestData.addon.fitness = INFINITY;
+    int bestRestart = -1;
+    mutex bestLock;
+    //Best finished fitness so far, for abandoning restarts
+    atomic<double> incumbent(INFINITY);
+    atomic<int> next(0);
+    atomic<int> ran(0);
+    atomic<int> abandoned(0);
+    //A deadline already set (by a sweep) is shared with the caller
+    long long deadline = opts.deadline != 0 ? opts.deadline : wallNs() + (long long)(opts.budget*1e9);
+    if(opts.budget > 0){
+        opts.deadline = deadline;
+    }
+    //A checkpoint that can't be used stops the run rather than silently starting afresh
+    vector<hub> resumeHubs;
+    const vector<hub> *resumed = nullptr;
+    if(!opts.resume.empty()){
+        vector<int> connections;
+        if(!ifstream(opts.resume).is_open()){
+            cerr << opts.resume << " couldn't be opened to resume from!\n";
+            exit(1);
+        }
+        if(!readCheckpoint(opts.resume, places, resumeHubs, connections)){
+            cerr << opts.resume << " isn't a checkpoint for these " << places.lat.size() << " places!\n";
+            exit(1);
+        }
+        if(resumeHubs.size() != nums){
+            cerr << opts.resume << " has " << resumeHubs.size() << " hubs, not " << nums << "!\n";
+            exit(1);
+        }
+        resumed = &resumeHubs;
+    }
+    thread saver = startSaving(progress);
+    if(opts.temper){
+        bestData = temper(places, boundaries, nums, loops, opts, resumed);
+        ran = bestData.restarts;
+    }else{
+        //Restarts stream into whichever workers are free, with a budget they
+        //keep coming until it runs out (always at least one)
+        auto another = [&](int i){
+            return opts.budget > 0 ? i == 0 || wallNs() < deadline : i < loops && (i == 0 || !pastDeadline(opts));
+        };
+        int workers = opts.budget > 0 ? pool().size() : min(loops, pool().size());
+        taskGroup restarts;
+        for(int w = 0; w < max(workers, 1); w++){
+            pool().submit(restarts, [&](){
+                for(int k = next++; another(k); k = next++){
+                    int i = opts.firstRestart + k;
+                    opInfo data;
+                    ran++;
+                    possible(i, boundaries, nums, places, data, opts, resumed, opts.abandon ? &incumbent : nullptr);
+                    if(data.abandoned){
+                        abandoned++;
+                        continue;
+                    }
+                    //Finding best result (the lowest restart wins a tie)
+                    lock_guard<mutex> guard(bestLock);
+                    if(data.addon.fitness < bestData.addon.fitness || (data.addon.fitness == bestData.addon.fitness && i < bestRestart)){
+                        bestData = data;
+                        bestRestart = i;
+                        incumbent = data.addon.fitness;
+                    }
+                }
+            });
+        }
+        pool().wait(restarts);
+    }
+    finishSaving(progress, saver);
+    bestData.restarts = ran;
+    bestData.abandoned = abandoned;
+    return bestData;
+}
+
+//Costliest places tried as the new hub when growing
+const int growCandidates = 64;
+
+//Adding a hub at whichever of the costliest places (population times distance
+//to their hub) would take the most off the total fitness
+vector<hub> addHub(const opInfo &from, const placeTable &places){
+    vector<hub> hubs = from.finals;
+    int n = (int)from.addon.connections.size();
+    vector<double> cost(n);
+    vector<int> order(n);
+    forChunks(n, [&](int c, int begin, int end){
+        for(int i = begin; i < end; i++){
+            const hub &own = hubs[from.addon.connections[i]];
+            cost[i] = tDist(own.lat*convert, own.lon*convert, cos(own.lat*convert), places, i)*places.pop[i];
+            order[i] = i;
+        }
+    });
+    int tried = min(n, growCandidates);
+    partial_sort(order.begin(), order.begin() + tried, order.end(), [&](int a, int b){
+        return cost[a] > cost[b] || (cost[a] == cost[b] && a < b);
+    });
+    //Saving at each candidate, from every place it would be closer to
+    vector<double> saving(tried, 0);
+    for(int k = 0; k < tried; k++){
+        int c = order[k];
+        vector<stableSum> partial(max(chunksOf(n), 1));
+        forChunks(n, [&](int chunk, int begin, int end){
+            for(int i = begin; i < end; i++){
+                double closer = cost[i] - pDist(places, c, i)*places.pop[i];
+                if(closer > 0){
+                    partial[chunk].add(closer);
+                }
+            }
+        });
+        saving[k] = sumChunks(partial);
+    }
+    countDistances((long long)(tried + 1)*n);
+    int best = order[max_element(saving.begin(), saving.end()) - saving.begin()];
+    hub added;
+    added.lat = places.lat[best]/convert;
+    added.lon = places.lon[best]/convert;
+    added.fitness = findFitness(added.lat, added.lon, places);
+    added.servicing = 0;
+    hubs.push_back(added);
+    return hubs;
+}
+
+//Solving for one more hub than from, starting from its hubs
+//(checkpointed like solve, and stopping at opts.deadline if one is set)
+opInfo growHubs(const opInfo &from, const placeTable &places, const settings &given){
+    settings opts = given;
+    anytime progress;
+    progress.file = opts.snapshot;
+    opts.progress = &progress;
+    thread saver = startSaving(progress);
+    opInfo output = descend(addHub(from, places), places, opts);
+    finishSaving(progress, saver);
+    output.restarts = 1;
+    return output;
+}
+
+/*
+ Round trips
+ Each hub's trip starts and ends at the hub. A nearest-neighbour tour is
+ built with a k-d tree that drops places as they are visited, then improved
+ with 2-opt and Or-opt moves towards each stop's tspNeighbours nearest stops.
+ Don't-look bits keep settled stops off the work queue.
+*/
+const int tspNeighbours = 8;
+const int orOptLength = 3;
+const double tspGain = 1e-9;
+
+//Trips up to this many stops keep every distance in a packed float triangle
+//(about 2MB each, and every hub's trip is built at once)
+const int packedStops = 1024;
+//Larger trips work distances out on demand, remembering this many (a power of two)
+const int cachedDistances = 1 << 16;
+
+//Distances between the stops of one hub's trip (stop n is the hub), memory
+//is linear in the stops apart from the packed triangle for small trips.
+//With a square cost matrix they are its costs instead (averaged both ways),
+//the hub being matrix row depotRow
+class tripDistances{
+public:
+    tripDistances(const placeTable &places, const vector<int> &ids, const hub &depot, const costMatrix *costs = nullptr, int depotRow = -1) : costs(costs){
+        n = (int)ids.size();
+        for(int i = 0; i < n; i++){
+            lat.push_back(places.lat[ids[i]]);
+            lon.push_back(places.lon[ids[i]]);
+            cosLat.push_back(places.cosLat[ids[i]]);
+            if(costs != nullptr){
+                rows.push_back(placeRow(places, ids[i]));
+            }
+        }
+        lat.push_back(depot.lat*convert);
+        lon.push_back(depot.lon*convert);
+        cosLat.push_back(cos(depot.lat*convert));
+        if(costs != nullptr){
+            rows.push_back(depotRow);
+        }
+        int m = n + 1;
+        if(m <= packedStops){
+            //Row b holds distances to every stop before it
+            packed.resize((size_t)m*(m - 1)/2);
+            for(int b = 1; b < m; b++){
+                for(int a = 0; a < b; a++){
+                    packed[(size_t)b*(b - 1)/2 + a] = (float)exact(a, b);
+                }
+            }
+        }else{
+            keys.assign(cachedDistances, 0);
+            values.resize(cachedDistances);
+        }
+    }
+    
+    //Distance used while improving the trip
+    double operator()(int a, int b) const{
+        if(a == b){
+            return 0;
+        }
+        if(a > b){
+            swap(a, b);
+        }
+        if(!packed.empty()){
+            return packed[(size_t)b*(b - 1)/2 + a];
+        }
+        //Direct-mapped cache, keys are stored plus one so zero is empty
+        uint64_t key = (uint64_t)b*(n + 1) + a + 1;
+        size_t slot = (key*0x9E3779B97F4A7C15ULL) >> 48 & (cachedDistances - 1);
+        if(keys[slot] != key){
+            keys[slot] = key;
+            values[slot] = exact(a, b);
+        }
+        return values[slot];
+    }
+    
+    //Full precision distance, never cached
+    double exact(int a, int b) const{
+        countDistances(1);
+        if(costs != nullptr){
+            return 0.5*((double)(*costs)(rows[a], rows[b]) + (*costs)(rows[b], rows[a]));
+        }
+        double sLat = sin((lat[b]-lat[a])/2);
+        double sLong = sin((lon[b]-lon[a])/2);
+        double h = sLat*sLat + cosLat[a]*cosLat[b]*sLong*sLong;
+        return R*2*atan2(sqrt(h) , sqrt(1.0-h));
+    }
+    
+private:
+    int n;
+    vector<double> lat, lon, cosLat;
+    const costMatrix *costs;
+    vector<int> rows;
+    vector<float> packed;
+    mutable vector<uint64_t> keys;
+    mutable vector<double> values;
+};
+
+//Structure for a trip being improved (a cyclic order of stops)
+struct tripOrder{
+    vector<int> stops;
+    //Position of each stop in stops
+    vector<int> pos;
+    int succ(int a) const{
+        return stops[(pos[a] + 1) % stops.size()];
+    }
+    int pred(int a) const{
+        return stops[(pos[a] + stops.size() - 1) % stops.size()];
+    }
+    //Reversing stops from position i forward to position j, or the rest of
+    //the cycle if that's shorter (the same trip either way)
+    void reverse(int i, int j){
+        int m = (int)stops.size();
+        int length = (j - i + m) % m + 1;
+        if(2*length > m){
+            int start = (j + 1) % m;
+            j = (i + m - 1) % m;
+            i = start;
+            length = m - length;
+        }
+        for(int k = 0; k < length/2; k++){
+            int a = (i + k) % m;
+            int b = (j - k + m) % m;
+            swap(stops[a], stops[b]);
+            pos[stops[a]] = a;
+            pos[stops[b]] = b;
+        }
+    }
+};
+
+//Trying 2-opt moves from stop a, true if one was made
+bool twoOpt(tripOrder &trip, const vector<int> &near, const tripDistances &d, int a, vector<int> &touched){
+    for(int dir = 0; dir < 2; dir++){
+        int b = dir == 0 ? trip.succ(a) : trip.pred(a);
+        double dab = d(a, b);
+        for(int k = 0; k < near.size(); k++){
+            int c = near[k];
+            double dac = d(a, c);
+            //Neighbours are nearest first, so nothing further on can help
+            if(dac >= dab){
+                break;
+            }
+            int e = dir == 0 ? trip.succ(c) : trip.pred(c);
+            if(c == b || e == a){
+                continue;
+            }
+            if(dac + d(b, e) - dab - d(c, e) < -tspGain){
+                if(dir == 0){
+                    trip.reverse(trip.pos[b], trip.pos[c]);
+                }else{
+                    trip.reverse(trip.pos[a], trip.pos[e]);
+                }
+                touched = {a, b, c, e};
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//Trying to move a run of up to orOptLength stops starting at a next to one
+//of its neighbours (either way round), true if one was moved
+bool orOpt(tripOrder &trip, const vector< vector<int> > &near, const tripDistances &d, int a, vector<int> &touched){
+    int m = (int)trip.stops.size();
+    for(int length = 1; length <= orOptLength && length + 3 <= m; length++){
+        int first = a;
+        int last = trip.stops[(trip.pos[a] + length - 1) % m];
+        int before = trip.pred(first);
+        int after = trip.succ(last);
+        double removed = d(before, first) + d(last, after) - d(before, after);
+        //Places in the run can't be insertion points
+        auto running = [&](int stop){
+            return (trip.pos[stop] - trip.pos[first] + m) % m < length;
+        };
+        for(int end = 0; end < 2; end++){
+            const vector<int> &list = near[end == 0 ? first : last];
+            for(int k = 0; k < list.size(); k++){
+                int c = list[k];
+                if(running(c)){
+                    continue;
+                }
+                //Edges either side of c, skipping the one the run already sits in
+                for(int side = 0; side < 2; side++){
+                    int u = side == 0 ? c : trip.pred(c);
+                    int v = side == 0 ? trip.succ(c) : c;
+                    if(running(u) || running(v)){
+                        continue;
+                    }
+                    double forward = d(u, first) + d(last, v) - d(u, v);
+                    double backward = d(u, last) + d(first, v) - d(u, v);
+                    bool flip = backward < forward;
+                    if(min(forward, backward) - removed < -tspGain){
+                        //Rebuilding the order: everything else from after, with the run dropped in after u
+                        vector<int> run;
+                        for(int r = 0; r < length; r++){
+                            run.push_back(trip.stops[(trip.pos[first] + r) % m]);
+                        }
+                        if(flip){
+                            std::reverse(run.begin(), run.end());
+                        }
+                        vector<int> stops;
+                        stops.reserve(m);
+                        for(int r = 0; r < m - length; r++){
+                            int stop = trip.stops[(trip.pos[after] + r) % m];
+                            stops.push_back(stop);
+                            if(stop == u){
+                                stops.insert(stops.end(), run.begin(), run.end());
+                            }
+                        }
+                        trip.stops = stops;
+                        for(int r = 0; r < m; r++){
+                            trip.pos[trip.stops[r]] = r;
+                        }
+                        touched = {before, after, first, last, u, v};
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+    return false;
+}
+
+//Finding one hub's round trip over the given places, as place indices in order
+collection roundTrip(const placeTable &places, const vector<int> &ids, const hub &depot, const tripDistances &d){
+    collection output;
+    int n = (int)ids.size();
+    int m = n + 1;
+    output.fitness = 0;
+    if(n == 0){
+        return output;
+    }
+    //Stop n is the hub
+    candidates points;
+    for(int i = 0; i < n; i++){
+        points.x.push_back(places.x[ids[i]]);
+        points.y.push_back(places.y[ids[i]]);
+        points.z.push_back(places.z[ids[i]]);
+    }
+    addCandidate(points, depot.lat, depot.lon);
+    kdTree tree = buildTree(points);
+    
+    //Nearest-neighbour tour, removing stops from the tree as they're visited
+    tripOrder trip;
+    trip.pos.resize(m);
+    int current = n;
+    removePoint(tree, n);
+    trip.stops.push_back(n);
+    for(int k = 1; k < m; k++){
+        current = nearestAlive(tree, points.x[current], points.y[current], points.z[current]);
+        removePoint(tree, current);
+        trip.stops.push_back(current);
+    }
+    for(int k = 0; k < m; k++){
+        trip.pos[trip.stops[k]] = k;
+    }
+    
+    //Improving with 2-opt and Or-opt, every stop starts on the queue
+    if(m >= 5){
+        tree = buildTree(points);
+        vector< vector<int> > near(m);
+        for(int i = 0; i < m; i++){
+            near[i] = nearestK(tree, points, i, min(tspNeighbours, m - 1));
+        }
+        deque<int> queue(trip.stops.begin(), trip.stops.end());
+        vector<char> queued(m, 1);
+        vector<int> touched;
+        while(!queue.empty()){
+            int a = queue.front();
+            queue.pop_front();
+            queued[a] = 0;
+            if(twoOpt(trip, near[a], d, a, touched) || orOpt(trip, near, d, a, touched)){
+                for(int t = 0; t < touched.size(); t++){
+                    if(!queued[touched[t]]){
+                        queued[touched[t]] = 1;
+                        queue.push_back(touched[t]);
+                    }
+                }
+            }
+        }
+    }
+    
+    //Starting from the hub and adding up the legs
+    int start = trip.pos[n];
+    for(int k = 1; k < m; k++){
+        output.connections.push_back(ids[trip.stops[(start + k) % m]]);
+    }
+    for(int k = 0; k < m; k++){
+        output.fitness += d.exact(trip.stops[k], trip.stops[(k + 1) % m]);
+    }
     return output;
 }
 
-//Optimising for _____multiple______ hubs
-opInfo multiBALL(vector< hub > oldHubs, vector< vector<double> > places, int minMax, double search){
-    //Setting variables
-    opInfo output;
-    collection standing;
-    collection newStanding;
-    
-    vector<hub> hubs = oldHubs;
-    vector<hub> testHubs;
-    vector< vector<double> > subPlaces;
+//Row of a square cost matrix a hub sits on (the site nearest it)
+int depotRow(const costMatrix &costs, const hub &depot){
+    int best = 0;
+    double bestD = INFINITY;
+    for(size_t s = 0; s < costs.sites; s++){
+        double dLat = costs.siteLat[s] - depot.lat;
+        double dLon = costs.siteLon[s] - depot.lon;
+        if(dLat*dLat + dLon*dLon < bestD){
+            bestD = dLat*dLat + dLon*dLon;
+            best = (int)s;
+        }
+    }
+    return best;
+}
+
+//Travelling Sales-person Problem, a round trip for every hub (in parallel),
+//priced by costs if they're given and square
+vector<collection> tsp(const placeTable &places, const opInfo &hubData, const costMatrix *costs = nullptr){
+    phaseTimer timer(routePhase);
+    int hubs = (int)hubData.finals.size();
+    vector<collection> output(hubs);
+    //Getting what places hubs are connected to
+    vector< vector<int> > ids(hubs);
+    for(int j = 0; j < hubData.addon.connections.size(); j++){
+        ids[hubData.addon.connections[j]].push_back(j);
+    }
+    taskGroup group;
+    for(int i = 0; i < hubs; i++){
+        pool().submit(group, [&, i](){
+            phaseTimer hubTimer(routePhase);
+            if(costs != nullptr && costs->square){
+                tripDistances d(places, ids[i], hubData.finals[i], costs, depotRow(*costs, hubData.finals[i]));
+                output[i] = roundTrip(places, ids[i], hubData.finals[i], d);
+                return;
+            }
+            tripDistances d(places, ids[i], hubData.finals[i]);
+            output[i] = roundTrip(places, ids[i], hubData.finals[i], d);
+        });
+    }
+    pool().wait(group);
+    return output;
+}
+
+/*
+ Batch mode
+ Scenarios are lines of key=value pairs, e.g.
+   hubs=3 restarts=8 accuracy=0.01 scope=10 optimiser=hill routes=1 seed=42
+ accuracy is in km like the interactive prompt, optimiser is hill or
+ weiszfeld, seeding is kmeans (default) or uniform. Blank lines and lines starting with # are skipped. Each result is
+ written as one line of JSON.
+*/
+bool parseScenario(const string &line, scenario &job, string &error){
+    stringstream fields(line);
+    string field, key, value;
+    while(fields >> field){
+        size_t equals = field.find('=');
+        if(equals == string::npos){
+            error = "expected key=value, got " + field;
+            return false;
+        }
+        key = field.substr(0, equals);
+        value = field.substr(equals + 1);
+        if(key == "hubs"){
+            job.hubs = atoi(value.c_str());
+        }else if(key == "restarts"){
+            job.restarts = atoi(value.c_str());
+        }else if(key == "accuracy"){
+            job.accuracy = atof(value.c_str());
+        }else if(key == "scope"){
+            job.opts.minMax = atoi(value.c_str());
+        }else if(key == "optimiser"){
+            if(value == "hill"){
+                job.opts.mode = hillClimbing;
+            }else if(value == "weiszfeld"){
+                job.opts.mode = weiszfeld;
+            }else{
+                error = "unknown optimiser " + value;
+                return false;
+            }
+        }else if(key == "routes"){
+            job.routes = value != "0";
+        }else if(key == "budget"){
+            job.opts.budget = atof(value.c_str());
+        }else if(key == "abandon"){
+            job.opts.abandon = value != "0";
+        }else if(key == "minpop"){
+            job.minPop = atof(value.c_str());
+        }else if(key == "region"){
+            if(sscanf(value.c_str(), "%lf,%lf,%lf,%lf", &job.minLat, &job.maxLat, &job.minLon, &job.maxLon) != 4){
+                error = "region needs minLat,maxLat,minLon,maxLon";
+                return false;
+            }
+            job.region = true;
+        }else if(key == "id"){
+            job.tag = value;
+        }else if(key == "sweep"){
+            job.sweep = value != "0";
+        }else if(key == "approx"){
+            job.opts.approx = value != "0";
+        }else if(key == "temper"){
+            job.opts.temper = value != "0";
+        }else if(key == "first"){
+            job.opts.firstRestart = atoi(value.c_str());
+        }else if(key == "coarse"){
+            job.opts.coarse = value != "0";
+        }else if(key == "seed"){
+            job.opts.seed = strtoull(value.c_str(), nullptr, 10);
+            job.opts.seeded = true;
+        }else if(key == "seeding"){
+            if(value == "kmeans"){
+                job.opts.start = kmeansSeeding;
+            }else if(value == "uniform"){
+                job.opts.start = uniformSeeding;
+            }else{
+                error = "unknown seeding " + value;
+                return false;
+            }
+        }else{
+            error = "unknown key " + key;
+            return false;
+        }
+    }
+    if(job.hubs < 1 || job.restarts < 1 || job.accuracy <= 0 || job.opts.minMax < 0){
+        error = "hubs and restarts must be at least 1, accuracy above 0 and scope not negative";
+        return false;
+    }
+    job.opts.search = job.accuracy/100;
+    job.opts.verbose = false;
+    return true;
+}
+
+//Writing a scenario back out as a line parseScenario gives the same job from
+//(every key, so settings from the command line are included)
+string scenarioLine(const scenario &job){
+    stringstream line;
+    line << setprecision(17) << "hubs=" << job.hubs << " restarts=" << job.restarts << " first=" << job.opts.firstRestart;
+    line << " accuracy=" << job.accuracy << " scope=" << job.opts.minMax;
+    line << " optimiser=" << (job.opts.mode == weiszfeld ? "weiszfeld" : "hill");
+    line << " seeding=" << (job.opts.start == kmeansSeeding ? "kmeans" : "uniform");
+    if(job.opts.seeded){
+        line << " seed=" << job.opts.seed;
+    }
+    line << " routes=" << job.routes << " budget=" << job.opts.budget << " abandon=" << job.opts.abandon;
+    line << " coarse=" << job.opts.coarse << " approx=" << job.opts.approx << " temper=" << job.opts.temper;
+    line << " sweep=" << job.sweep << " minpop=" << job.minPop;
+    if(job.region){
+        line << " region=" << job.minLat << "," << job.maxLat << "," << job.minLon << "," << job.maxLon;
+    }
+    if(!job.tag.empty()){
+        line << " id=" << job.tag;
+    }
+    return line.str();
+}
+
+//Writing a list of numbers as JSON
+template <typename T>
+void writeList(ostream &out, const vector<T> &list){
+    out << "[";
+    for(int i = 0; i < list.size(); i++){
+        out << (i ? "," : "") << list[i];
+    }
+    out << "]";
+}
+
+//Quoting text as a JSON string (ids and errors come from query lines)
+string jsonString(const string &text){
+    ostringstream out;
+    out << '"';
+    for(unsigned char c : text){
+        if(c == '"' || c == '\\'){
+            out << '\\' << c;
+        }else if(c < 0x20){
+            out << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec << setfill(' ');
+        }else{
+            out << c;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+//Writing one scenario's result as a line of JSON
+//(chosen maps a filtered scenario's places back to the dataset, if it has one)
+void writeResult(ostream &out, int number, const scenario &job, const opInfo &result, const vector<collection> &trips, const placeTable &places, double seconds, const vector<int> *chosen = nullptr){
+    out << setprecision(12);
+    out << "{\"scenario\":" << number;
+    if(!job.tag.empty()){
+        out << ",\"id\":" << jsonString(job.tag);
+    }
+    out << ",\"hubs\":" << job.hubs << ",\"restarts\":" << job.restarts << ",\"first\":" << job.opts.firstRestart;
+    out << ",\"accuracy\":" << job.accuracy << ",\"scope\":" << job.opts.minMax;
+    out << ",\"optimiser\":\"" << (job.opts.mode == weiszfeld ? "weiszfeld" : "hill") << "\"";
+    out << ",\"seeding\":\"" << (job.opts.start == kmeansSeeding ? "kmeans" : "uniform") << "\",\"seed\":" << job.opts.seed;
+    out << ",\"coarse\":" << (job.opts.coarse ? "true" : "false") << ",\"approx\":" << (job.opts.approx ? "true" : "false");
+    out << ",\"budget\":" << job.opts.budget << ",\"sweep\":" << (job.sweep ? "true" : "false") << ",\"temper\":" << (job.opts.temper ? "true" : "false");
+    out << ",\"restarts_run\":" << result.restarts << ",\"abandoned\":" << result.abandoned;
+    out << ",\"fitness\":" << result.addon.fitness << ",\"iterations\":" << result.iterations << ",\"seconds\":" << seconds;
+    //Places connected to each hub
+    vector< vector<int> > ids(result.finals.size());
+    for(int j = 0; j < result.addon.connections.size(); j++){
+        ids[result.addon.connections[j]].push_back(j);
+    }
+    out << ",\"found\":[";
+    for(int i = 0; i < result.finals.size(); i++){
+        double servicing = 0;
+        for(int j = 0; j < ids[i].size(); j++){
+            servicing += places.pop[ids[i][j]];
+        }
+        out << (i ? "," : "") << "{\"lat\":" << result.finals[i].lat << ",\"lon\":" << result.finals[i].lon;
+        out << ",\"servicing\":" << servicing << ",\"places\":" << ids[i].size() << "}";
+    }
+    out << "]";
+    //Dataset index of each connection when only some places were used
+    if(chosen != nullptr){
+        out << ",\"place_ids\":";
+        writeList(out, *chosen);
+    }
+    out << ",\"connections\":";
+    writeList(out, result.addon.connections);
+    //Round trips as dataset place indices (the hub itself is left out)
+    out << ",\"routes\":[";
+    for(int i = 0; i < trips.size(); i++){
+        vector<int> stops = trips[i].connections;
+        if(chosen != nullptr){
+            for(int j = 0; j < stops.size(); j++){
+                stops[j] = (*chosen)[stops[j]];
+            }
+        }
+        out << (i ? "," : "") << "{\"length\":" << trips[i].fitness << ",\"stops\":";
+        writeList(out, stops);
+        out << "}";
+    }
+    out << "]}\n";
+    out.flush();
+}
+
+//Whether a scenario only uses some of the places
+bool filters(const scenario &job){
+    return job.minPop > 0 || job.region;
+}
+
+//Places a scenario uses: a view of the chosen ones if it filters (chosen
+//must outlive it), otherwise the whole table
+placeTable scenarioPlaces(const placeTable &places, const scenario &job, vector<int> &chosen){
+    if(!filters(job)){
+        return places;
+    }
+    chosen.clear();
+    for(int i = 0; i < places.lat.size(); i++){
+        double lat = places.lat[i]/convert;
+        double lon = places.lon[i]/convert;
+        if(places.pop[i] >= job.minPop && (!job.region || (lat >= job.minLat && lat <= job.maxLat && lon >= job.minLon && lon <= job.maxLon))){
+            chosen.push_back(i);
+        }
+    }
+    return subView(places, chosen);
+}
+
+//Writing a scenario that couldn't be run
+void writeError(ostream &out, int number, const scenario &job, const string &error){
+    out << "{\"scenario\":" << number;
+    if(!job.tag.empty()){
+        out << ",\"id\":" << jsonString(job.tag);
+    }
+    out << ",\"error\":" << jsonString(error) << "}\n";
+    out.flush();
+}
+
+//Solving a sweep=1 scenario for 1 hub up to its hubs, each step growing
+//the last, and writing one result line per hub count. Gives how many
+//hub counts were reached before any budget ran out
+int sweepScenario(const placeTable &all, const scenario &job, int number, ostream &out){
+    vector<int> chosen;
+    placeTable places = scenarioPlaces(all, job, chosen);
+    if(places.lat.size() == 0){
+        writeError(out, number, job, "no places match the filter");
+        return 0;
+    }
+    bounds boundaries = getBounds(places);
+    //One deadline for the whole sweep, the first step running its
+    //restarts rather than filling the budget with them
+    settings opts = job.opts;
+    if(opts.budget > 0){
+        opts.deadline = wallNs() + (long long)(opts.budget*1e9);
+        opts.budget = 0;
+    }
+    //Restarts only for the first step
+    opInfo result;
+    int k = 1;
+    for(; k <= job.hubs && (k == 1 || !pastDeadline(opts)); k++){
+        auto start = chrono::steady_clock::now();
+        result = k == 1 ? solve(places, boundaries, 1, job.restarts, opts) : growHubs(result, places, opts);
+        vector<collection> trips;
+        if(job.routes){
+            trips = tsp(places, result, job.opts.costs);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        scenario step = job;
+        step.hubs = k;
+        writeResult(out, number, step, result, trips, places, seconds, filters(job) ? &chosen : nullptr);
+    }
+    return k - 1;
+}
+
+//Solving one scenario and writing its result (a line per hub count for a sweep)
+void answerScenario(const placeTable &all, const scenario &job, int number, ostream &out){
+    if(job.sweep){
+        sweepScenario(all, job, number, out);
+        return;
+    }
+    auto start = chrono::steady_clock::now();
+    vector<int> chosen;
+    placeTable places = scenarioPlaces(all, job, chosen);
+    if(places.lat.size() == 0){
+        writeError(out, number, job, "no places match the filter");
+        return;
+    }
+    opInfo result = solve(places, getBounds(places), job.hubs, job.restarts, job.opts);
+    vector<collection> trips;
+    if(job.routes){
+        trips = tsp(places, result, job.opts.costs);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    writeResult(out, number, job, result, trips, places, seconds, filters(job) ? &chosen : nullptr);
+}
+
+//Running every scenario back to back against the one loaded dataset
+int runBatch(const placeTable &places, const vector<string> &lines, string outName, const settings &defaults){
+    vector<scenario> jobs;
+    string error;
+    for(int i = 0; i < lines.size(); i++){
+        if(lines[i].empty() || lines[i].find_first_not_of(" \t\r") == string::npos || lines[i][lines[i].find_first_not_of(" \t")] == '#'){
+            continue;
+        }
+        scenario job;
+        job.opts = defaults;
+        if(!parseScenario(lines[i], job, error)){
+            cerr << "Scenario line " << (i+1) << ": " << error << "\n";
+            return 1;
+        }
+        //Every scenario gets its seed up front so it can be reported and rerun
+        pickSeed(job.opts);
+        jobs.push_back(job);
+    }
+    ofstream file;
+    if(!outName.empty()){
+        file.open(outName);
+        if(!file.is_open()){
+            cerr << outName << " couldn't be written!\n";
+            return 1;
+        }
+    }
+    ostream &out = outName.empty() ? cout : file;
     
+    for(int i = 0; i < jobs.size(); i++){
+        auto start = chrono::steady_clock::now();
+        if(jobs[i].sweep){
+            int swept = sweepScenario(places, jobs[i], i + 1, out);
+            if(swept == 0){
+                cerr << "Scenario " << (i+1) << ": no places match the filter\n";
+                continue;
+            }
+            double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cerr << "Scenario " << (i+1) << "/" << jobs.size() << " swept 1-" << swept << " hubs in " << total << "s";
+            cerr << (swept < jobs[i].hubs ? " (out of time)\n" : "\n");
+            continue;
+        }
+        answerScenario(places, jobs[i], i + 1, out);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cerr << "Scenario " << (i+1) << "/" << jobs.size() << " done in " << seconds << "s\n";
+    }
+    return 0;
+}
+
+/*
+ Shards
+ One job's restarts can be split over processes (or machines) by giving
+ each a range: --shard runs restarts first..first+restarts-1 of a single
+ seeded scenario and writes the best as a checkpoint followed by the whole
+ scenario (command line settings included) and what ran, e.g.
+   scenario hubs=10 restarts=8 first=8 accuracy=1 ... seed=42 ...
+   range 8 16
+   restarts_run 8
+   abandoned 0
+   restart 13
+   iterations 21
+   seconds 9.5
+ range is the restart numbers the shard drew seeds for (tempering's chains
+ count, not its steps). --merge reads any number of these, checks they are
+ the same job (every key but first= and restarts=) with no two ranges
+ overlapping, and writes the best (the lowest restart wins a tie) as one JSON result,
+ working out its round trips unless the scenario has routes=0. Shards on
+ one box should share it out with --threads (and numactl to pin them).
+*/
+//Structure for what one shard found
+struct shardResult{
+    string line;
+    int first = 0;
+    int end = 0;
+    double fitness = INFINITY;
+    vector<hub> hubs;
+    vector<int> connections;
+    int ran = 0;
+    int abandoned = 0;
+    int restart = -1;
     int iterations = 0;
-    bool testing = true;
-    //Setting standing fitness and also starting new standing fitness
-    standing = findDualFitnesses(hubs, places);
-    newStanding = findDualFitnesses(hubs, places);
-    //Staring loop
-    while(testing) {
-        testing = false;
-        iterations++;
-        //Looping through each hub
-        for(int i = 0; i < hubs.size(); i++){
-            //Getting conenctions, making each hub optimised for the cities it is connected to
-            for(int j = 0; j < standing.connections.size(); j++){
-                if(standing.connections[j] == i){
-                    subPlaces.push_back(places[j]);
-                }
+    double seconds = 0;
+};
+
+//Running one shard's restarts and writing them to fileName
+int runShard(const placeTable &all, const vector<string> &lines, string fileName, const settings &defaults){
+    vector<string> jobs;
+    for(int i = 0; i < lines.size(); i++){
+        if(lines[i].find_first_not_of(" \t\r") != string::npos && lines[i][lines[i].find_first_not_of(" \t")] != '#'){
+            jobs.push_back(lines[i]);
+        }
+    }
+    scenario job;
+    job.opts = defaults;
+    string error;
+    if(jobs.size() != 1){
+        error = "a shard runs exactly one scenario";
+    }else if(parseScenario(jobs[0], job, error)){
+        if(!job.opts.seeded){
+            error = "shards need a seed (seed= or --seed) so they run different restarts of one job";
+        }else if(job.sweep){
+            error = "sweeps can't be sharded";
+        }
+    }
+    if(!error.empty()){
+        cerr << "Shard: " << error << "\n";
+        return 1;
+    }
+    auto start = chrono::steady_clock::now();
+    vector<int> chosen;
+    placeTable places = scenarioPlaces(all, job, chosen);
+    if(places.lat.size() == 0){
+        cerr << "Shard: no places match the filter\n";
+        return 1;
+    }
+    opInfo result = solve(places, getBounds(places), job.hubs, job.restarts, job.opts);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    int end = job.opts.firstRestart + (job.opts.temper ? max(temperChains, pool().size()) : result.restarts);
+    stringstream extra;
+    extra << setprecision(17) << "scenario " << scenarioLine(job) << "\n";
+    extra << "range " << job.opts.firstRestart << " " << end << "\n";
+    extra << "restarts_run " << result.restarts << "\nabandoned " << result.abandoned << "\nrestart " << result.restart << "\n";
+    extra << "iterations " << result.iterations << "\nseconds " << seconds << "\n";
+    writeCheckpoint(fileName, result.addon.fitness, result.finals, result.addon.connections, extra.str());
+    cerr << "Shard of restarts " << job.opts.firstRestart << "-" << (end - 1) << " found " << result.addon.fitness << " in " << seconds << "s, wrote " << fileName << "\n";
+    return 0;
+}
+
+//Reading a shard, false if it isn't one
+bool readShard(string fileName, shardResult &shard){
+    ifstream file(fileName);
+    string line, key;
+    while(getline(file, line)){
+        stringstream fields(line);
+        fields >> key;
+        if(key == "scenario"){
+            shard.line = line.substr(line.find(' ') + 1);
+        }else if(key == "fitness"){
+            fields >> shard.fitness;
+        }else if(key == "range"){
+            fields >> shard.first >> shard.end;
+        }else if(key == "restarts_run"){
+            fields >> shard.ran;
+        }else if(key == "abandoned"){
+            fields >> shard.abandoned;
+        }else if(key == "restart"){
+            fields >> shard.restart;
+        }else if(key == "iterations"){
+            fields >> shard.iterations;
+        }else if(key == "seconds"){
+            fields >> shard.seconds;
+        }
+    }
+    return !shard.line.empty() && shard.end > shard.first;
+}
+
+//What makes shards parts of the same job: the scenario without its range
+string jobKey(scenario job){
+    job.restarts = 1;
+    job.opts.firstRestart = 0;
+    return scenarioLine(job);
+}
+
+//Merging shards of one job into its result
+int mergeShards(const placeTable &all, const vector<string> &fileNames, string outName, const settings &defaults){
+    scenario job;
+    vector<int> chosen;
+    placeTable places;
+    shardResult best;
+    int restarts = 0;
+    int ran = 0;
+    int abandoned = 0;
+    double seconds = 0;
+    string key;
+    //Restart ranges taken so far, with the shard each came from
+    vector< pair< pair<int, int>, int > > ranges;
+    for(int f = 0; f < fileNames.size(); f++){
+        shardResult shard;
+        scenario own;
+        own.opts = defaults;
+        string error;
+        if(!readShard(fileNames[f], shard) || !parseScenario(shard.line, own, error)){
+            cerr << fileNames[f] << " isn't a shard!" << (error.empty() ? "" : " (" + error + ")") << "\n";
+            return 1;
+        }
+        if(f == 0){
+            job = own;
+            key = jobKey(own);
+            places = scenarioPlaces(all, job, chosen);
+        }else if(jobKey(own) != key){
+            cerr << fileNames[f] << " is from a different job to " << fileNames[0] << ":\n  " << jobKey(own) << "\n  " << key << "\n";
+            return 1;
+        }
+        for(int r = 0; r < ranges.size(); r++){
+            if(shard.first < ranges[r].first.second && ranges[r].first.first < shard.end){
+                cerr << fileNames[f] << " ran restarts " << shard.first << "-" << (shard.end - 1) << ", overlapping " << ranges[r].first.first << "-" << (ranges[r].first.second - 1) << " from " << fileNames[ranges[r].second] << "\n";
+                return 1;
             }
-            //Optimising each hub
-            testHubs.push_back(hubs[i]);
-            hubs[i] = optimise(testHubs, subPlaces, search, minMax).finals[0];
-            testHubs.clear();
-            subPlaces.clear();
         }
-        //Making a new standing
-        newStanding = findDualFitnesses(hubs, places);
-        //Checking to see if new fitness is better than the old one
-        if(newStanding.fitness<standing.fitness){
-            testing = true;
-            standing = findDualFitnesses(hubs, places);
+        ranges.push_back(make_pair(make_pair(shard.first, shard.end), f));
+        if(!readCheckpoint(fileNames[f], places, shard.hubs, shard.connections)){
+            cerr << fileNames[f] << " doesn't fit " << places.lat.size() << " places!\n";
+            return 1;
+        }
+        restarts += own.restarts;
+        ran += shard.ran;
+        abandoned += shard.abandoned;
+        //Shards run side by side, so the job took as long as the slowest
+        seconds = max(seconds, shard.seconds);
+        if(shard.fitness < best.fitness || (shard.fitness == best.fitness && shard.restart < best.restart)){
+            best = shard;
+        }
+    }
+    if(best.hubs.empty()){
+        cerr << "No shard found anything to merge\n";
+        return 1;
+    }
+    opInfo result;
+    result.finals = best.hubs;
+    result.addon.fitness = best.fitness;
+    result.addon.connections = best.connections;
+    result.iterations = best.iterations;
+    result.restarts = ran;
+    result.abandoned = abandoned;
+    result.restart = best.restart;
+    job.restarts = restarts;
+    job.opts.firstRestart = 0;
+    vector<collection> trips;
+    if(job.routes){
+        trips = tsp(places, result, job.opts.costs);
+    }
+    ofstream file;
+    if(!outName.empty()){
+        file.open(outName);
+        if(!file.is_open()){
+            cerr << outName << " couldn't be written!\n";
+            return 1;
+        }
+    }
+    writeResult(outName.empty() ? cout : file, 1, job, result, trips, places, seconds, filters(job) ? &chosen : nullptr);
+    cerr << "Merged " << fileNames.size() << " shards (" << ran << " restarts), best from restart " << best.restart << "\n";
+    return 0;
+}
+
+/*
+ Server mode
+ Keeps the dataset in memory and answers query lines, each a scenario
+ (including minpop=, region= and id=), with one JSON line. Each query gets
+ its own thread, which hands its solve's restarts to the pool and sleeps
+ until they finish (a pool worker waiting on one query would run another
+ nested under it, holding up the first reply). Replies can come back out
+ of order and are matched up by scenario number or id. "quit" ends the
+ session.
+*/
+void serveLines(const placeTable &places, const settings &defaults, function<bool(string &)> next, function<void(const string &)> reply){
+    vector<thread> queries;
+    string line;
+    int number = 0;
+    while(next(line)){
+        if(!line.empty() && line.back() == '\r'){
+            line.pop_back();
+        }
+        size_t first = line.find_first_not_of(" \t");
+        if(first == string::npos || line[first] == '#'){
+            continue;
+        }
+        if(line.compare(first, 4, "quit") == 0){
+            break;
+        }
+        number++;
+        queries.emplace_back([&places, &defaults, &reply, line, number](){
+            scenario job;
+            job.opts = defaults;
+            string error;
+            ostringstream out;
+            if(parseScenario(line, job, error)){
+                pickSeed(job.opts);
+                answerScenario(places, job, number, out);
+            }else{
+                writeError(out, number, job, error);
+            }
+            reply(out.str());
+        });
+    }
+    for(thread &query : queries){
+        query.join();
+    }
+}
+
+//Serving stdin to stdout
+void serveStdio(const placeTable &places, const settings &defaults){
+    mutex writing;
+    serveLines(places, defaults, [](string &line){
+        return (bool)getline(cin, line);
+    }, [&](const string &text){
+        lock_guard<mutex> guard(writing);
+        cout << text;
+        cout.flush();
+    });
+}
+
+//Serving every connection to a Unix domain socket on its own thread
+int serveSocket(const placeTable &places, const settings &defaults, string path){
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)){
+        cerr << path << " is too long for a socket path!\n";
+        return 1;
+    }
+    strcpy(address.sun_path, path.c_str());
+    //Only a stale socket is cleared away, never some other file
+    struct stat existing;
+    if(lstat(path.c_str(), &existing) == 0){
+        if(!S_ISSOCK(existing.st_mode)){
+            cerr << path << " already exists and isn't a socket!\n";
+            return 1;
         }
+        unlink(path.c_str());
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server < 0 || ::bind(server, (sockaddr *)&address, sizeof(address)) != 0 || listen(server, 16) != 0){
+        cerr << path << " couldn't be listened on!\n";
+        return 1;
+    }
+    cerr << "Listening on " << path << "\n";
+    while(true){
+        int client = accept(server, nullptr, nullptr);
+        if(client < 0){
+            continue;
+        }
+        thread([&places, defaults, client](){
+            string pending;
+            char buffer[4096];
+            mutex writing;
+            serveLines(places, defaults, [&](string &line){
+                while(true){
+                    size_t end = pending.find('\n');
+                    if(end != string::npos){
+                        line = pending.substr(0, end);
+                        pending.erase(0, end + 1);
+                        return true;
+                    }
+                    ssize_t got = read(client, buffer, sizeof(buffer));
+                    if(got <= 0){
+                        return false;
+                    }
+                    pending.append(buffer, got);
+                }
+            }, [&](const string &text){
+                lock_guard<mutex> guard(writing);
+                size_t sent = 0;
+                while(sent < text.size()){
+                    ssize_t put = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+                    if(put <= 0){
+                        break;
+                    }
+                    sent += put;
+                }
+            });
+            close(client);
+        }).detach();
+    }
+}
+
+/*
+ Synthetic datasets
+ Deterministic for a given seed: most places cluster around UK population
+ centres (spread scaled by city size) with a rural scatter over the island,
+ and populations are log-normal.
+*/
+dataset synthPlaces(size_t n, uint64_t seed){
+    //Centres as lat, long, weight (millions) and spread (degrees)
+    const double centres[][4] = {
+        {51.51, -0.13, 9.0, 0.35}, {53.48, -2.24, 2.8, 0.25}, {52.49, -1.89, 2.6, 0.22},
+        {53.80, -1.55, 1.9, 0.22}, {55.86, -4.25, 1.7, 0.20}, {53.38, -1.47, 0.7, 0.12},
+        {53.41, -2.98, 0.9, 0.15}, {54.98, -1.61, 0.8, 0.15}, {52.95, -1.15, 0.7, 0.12},
+        {51.45, -2.59, 0.7, 0.15}, {55.95, -3.19, 0.5, 0.12}, {51.48, -3.18, 0.5, 0.15},
+        {54.60, -5.93, 0.6, 0.20}, {50.82, -0.14, 0.5, 0.12}, {50.90, -1.40, 0.8, 0.18},
+        {52.63, 1.30, 0.4, 0.20}, {57.15, -2.09, 0.2, 0.10}, {50.38, -4.14, 0.3, 0.12},
+        {52.41, -1.51, 0.4, 0.10}, {53.74, -0.33, 0.3, 0.10}, {52.21, 0.12, 0.3, 0.12}
+    };
+    const int numCentres = sizeof(centres)/sizeof(centres[0]);
+    const double rural = 0.08;
+    
+    mt19937_64 generate(seed);
+    vector<double> weights;
+    for(int c = 0; c < numCentres; c++){
+        weights.push_back(centres[c][2]);
     }
+    discrete_distribution<int> pickCentre(weights.begin(), weights.end());
+    uniform_real_distribution<> unit(0, 1);
+    normal_distribution<> normal(0, 1);
+    lognormal_distribution<> population(7.0, 1.4);
     
-    output.iterations=iterations;
-    output.finals=hubs;
-    output.addon=standing;
+    dataset output;
+    double *base = allocTable(output.places, n);
+    shared_ptr< vector<uint64_t> > offsets = make_shared< vector<uint64_t> >(1, 0);
+    shared_ptr<string> chars = make_shared<string>();
+    offsets->reserve(n + 1);
+    double lat, lon;
+    for(size_t i = 0; i < n; i++){
+        if(unit(generate) < rural){
+            lat = 50.2 + 8.3*unit(generate);
+            lon = -5.5 + 7.2*unit(generate);
+        }else{
+            const double *c = centres[pickCentre(generate)];
+            lat = c[0] + c[3]*normal(generate);
+            lon = c[1] + c[3]*normal(generate)/cos(c[0]*convert);
+        }
+        setPlace(base, n, i, lat, lon, round(population(generate)) + 10);
+        *chars += "Synth" + to_string(i);
+        offsets->push_back(chars->size());
+    }
+    output.names = makeNames(offsets, chars);
     return output;
 }
 
-//Generating random hubs
-vector<hub> getHubs(bounds boundaries, int numOfHubs, vector<vector<double> > places){
-    vector<hub> hubs;
-    //Randomness generator
-    random_device random;
-    //Using Mersenne Twister engine (64 bit unsigned)
-    mt19937_64 generate(random());
-    uniform_real_distribution<> distLat(boundaries.minLat,boundaries.maxLat);
-    uniform_real_distribution<> distLong(boundaries.minLong,boundaries.maxLong);
-    hub alpha;
-    //Setting random hubs
+//Writing a dataset back out as csv
+void writeCsv(const dataset &data, string fileName){
+    ofstream file(fileName);
+    if(!file.is_open()){
+        cout << fileName << " couldn't be written!" << "\n";
+        exit(1);
+    }
+    file << "Place,Type,Population,Latitude,Longitude\n" << setprecision(8);
+    for(int i = 0; i < data.places.lat.size(); i++){
+        file << getName(data.names, i) << ",Synthetic," << data.places.pop[i] << "," << data.places.lat[i]/convert << "," << data.places.lon[i]/convert << "\n";
+    }
+    file.close();
+    cout << "Wrote " << data.places.lat.size() << " places to " << fileName << "\n";
+}
+
+/*
+ Benchmarks
+ Each kernel runs until it has taken at least benchSeconds. Rows are csv:
+   benchmark,places,hubs,reps,seconds,evals_per_sec,fitness
+ seconds is per rep. evals are distance evaluations, except for
+ findDualFitnesses where they are places assigned. Solver rows give the time
+ to converge and the final fitness from fixed (seeded) starting hubs.
+*/
+const double benchSeconds = 0.3;
+
+//Timing repeated runs, returns seconds per run
+template <typename F>
+double timeRuns(F run, int &reps){
+    auto start = chrono::steady_clock::now();
+    double seconds = 0;
+    reps = 0;
+    while(reps == 0 || seconds < benchSeconds){
+        run();
+        reps++;
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    return seconds/reps;
+}
+
+void benchRow(string name, size_t n, int hubs, int reps, double seconds, double evals, double fitness){
+    cout << name << "," << n << "," << hubs << "," << reps << "," << seconds << "," << (evals > 0 ? evals/seconds : 0) << "," << fitness << "\n";
+    cout.flush();
+}
+
+//Fixed starting hubs for the solver benchmarks
+vector<hub> benchHubs(const placeTable &places, int numOfHubs, uint64_t seed){
+    bounds boundaries = getBounds(places);
+    mt19937_64 generate(seed);
+    uniform_real_distribution<> distLat(boundaries.minLat, boundaries.maxLat);
+    uniform_real_distribution<> distLong(boundaries.minLong, boundaries.maxLong);
+    vector<hub> hubs(numOfHubs);
     for(int i = 0; i < numOfHubs; i++){
-        alpha.lat = distLat(generate);
-        alpha.lon = distLong(generate);
-        alpha.fitness = findFitness(alpha.lat, alpha.lon, places);
-        alpha.servicing = 0;
-        hubs.push_back(alpha);
+        hubs[i].lat = distLat(generate);
+        hubs[i].lon = distLong(generate);
+        hubs[i].fitness = findFitness(hubs[i].lat, hubs[i].lon, places);
+        hubs[i].servicing = 0;
     }
     return hubs;
 }
 
-//Calculating possibilities concurrently
-void possible(int i, bounds boundaries, int nums, vector<vector<double>> places, vector<opInfo> &data, int minMax, double search){
-    vector<hub> hubsA;
-    opInfo moreData;
-    cout << "Starting thread " << i << "\n";
-    //Getting hubs and data for hubs (includes optimisation)
-    hubsA = getHubs(boundaries, nums, places);
-    moreData = multiBALL(hubsA, places, minMax, search);
-    //Outputting results
-    hubsA = moreData.finals;
-    cout << "Thread " << i << " has node length " << moreData.addon.fitness <<"\n";
-    data.push_back(moreData);
-}
-
-//Adjecency matrix
-vector<vector< vector <double> > > adj(vector<vector<double>> places, opInfo hubData){
-    vector< vector< vector <double> > > matricies;
-    vector<double> dists;
-    vector< vector <double> > adjs;
-    vector< vector <double> > subPlaces;
-    hub testHub;
-    //Going through all the hubs
-    for(int i=0;i<hubData.finals.size();i++){
-        testHub=hubData.finals[i];
-        //Getting what places hubs are connected to
-        for(int j=0;j<hubData.addon.connections.size();j++){
-            if(hubData.addon.connections[j]==i){
-                subPlaces.push_back(places[j]);
-            }
-        }
-        //Making adjacency matrix
-        for(int j=0;j<=subPlaces.size();j++){
-            for(int k=0;k<=subPlaces.size();k++){
-                if(j+k==2*subPlaces.size()){
-                    dists.push_back(0);
-                }else if(j==subPlaces.size()&&k!=subPlaces.size()){
-                    dists.push_back(dist(hubData.finals[i].lat, subPlaces[k][3], hubData.finals[i].lon, subPlaces[k][4], subPlaces[k][2]));
-                }else if(k==subPlaces.size()&&j!=subPlaces.size()){
-                    dists.push_back(dist(hubData.finals[i].lat, subPlaces[j][3], hubData.finals[i].lon, subPlaces[j][4], subPlaces[j][2]));
-                }else{
-                    dists.push_back(dist(subPlaces[k][3], subPlaces[j][3], subPlaces[k][4], subPlaces[j][4], subPlaces[j][2]));
-                }
-            }
-            adjs.push_back(dists);
-            dists.clear();
-        }
-        matricies.push_back(adjs);
-        adjs.clear();
-        subPlaces.clear();
-    }
-    //Outputting result
-    return matricies;
-}
-
-//Travelling Sales-person Problem
-vector<collection> tsp(vector<vector<double>> places, opInfo hubData){
-    vector<collection> output;
-    vector< vector< vector<double> > > adjMat;
-    adjMat=adj(places,hubData);
-    collection data;
-    vector<int> path;
-    double pathLength=0;
-    int smallest=-1;
-    double min;
-    
-    //looping within matrix to perform nearest-neighbour algorithm
-    for(int i=0;i<adjMat.size();i++){
-        bool looking=true;
-        int j=(int)adjMat[i].size()-1;
-        path.push_back(j);
-        while(looking){
-            smallest=-1;
-            min=INFINITY;
-            //Finding nearest neighbour and eliminating node from path
-            for(int k=0;k<adjMat[i].size();k++){
-                bool valid=true;
-                for(int l=0;l<path.size();l++){
-                    valid=valid&&path[l]!=k;
-                }
-                if(adjMat[i][j][k]<min && k!=j && valid){
-                    min=adjMat[i][j][k];
-                    smallest=k;
-                }
-            }
-            //Adding nearest node to path
-            pathLength+=min;
-            j=smallest;
-            path.push_back(j);
-            looking=path.size()!=adjMat[i].size();
-        }
-        j=(int)adjMat[i].size()-1;
-        pathLength+=adjMat[i][smallest][j];
-        path.push_back(j);
-        //Using opInfo for TSP data
-        data.connections=path;
-        data.fitness=pathLength;
-        output.push_back(data);
-        path.clear();
-        pathLength=0;
+void runBench(int lowExp, int highExp){
+    cout << "benchmark,places,hubs,reps,seconds,evals_per_sec,fitness\n" << setprecision(6);
+    for(int e = lowExp; e <= highExp; e++){
+        size_t n = (size_t)llround(pow(10, e));
+        dataset data = synthPlaces(n, 1000 + e);
+        const placeTable &places = data.places;
+        int reps;
+        double seconds, sum = 0;
+        
+        //Single distances through the degree interface
+        seconds = timeRuns([&](){
+            for(int i = 0; i < n; i++){
+                sum += hDist(53.0, places.lat[i]/convert, -1.5, places.lon[i]/convert, places.pop[i]);
+            }
+        }, reps);
+        benchRow("hDist", n, 1, reps, seconds, n, sum/reps);
+        
+        double fitness = 0;
+        seconds = timeRuns([&](){ fitness = findFitness(53.0, -1.5, places); }, reps);
+        benchRow("findFitness", n, 1, reps, seconds, n, fitness);
+        
+        //A full scope 10 stencil in one batch
+        candidates stencil;
+        for(int i = -10; i <= 10; i++){
+            for(int j = -10; j <= 10; j++){
+                if(i != 0 || j != 0){
+                    addCandidate(stencil, 53.0 + i*0.01, -1.5 + j*0.01);
+                }
+            }
+        }
+        vector<double> fits;
+        seconds = timeRuns([&](){ fits = batchFitness(stencil, places); }, reps);
+        benchRow("batchFitness", n, (int)stencil.x.size(), reps, seconds, (double)n*stencil.x.size(), fits[0]);
+        
+        int hubCounts[3] = {5, 20, 50};
+        for(int h = 0; h < 3; h++){
+            vector<hub> hubs = benchHubs(places, hubCounts[h], 7);
+            collection col;
+            seconds = timeRuns([&](){ col = findDualFitnesses(hubs, places); }, reps);
+            benchRow("findDualFitnesses", n, hubCounts[h], reps, seconds, n, col.fitness);
+        }
+        
+        hub start = benchHubs(places, 1, 11)[0];
+        seconds = timeRuns([&](){
+            hub moved = start;
+            hillClimb(moved, 0.01, places, 10);
+            fitness = moved.fitness;
+        }, reps);
+        benchRow("hillClimb", n, 1, reps, seconds, 440.0*n, fitness);
+        seconds = timeRuns([&](){
+            hub moved = start;
+            hillClimb(moved, 0.01, places, 10, true);
+            fitness = moved.fitness;
+        }, reps);
+        benchRow("hillClimb-approx", n, 1, reps, seconds, 441.0*n, fitness);
+        
+        //End to end solvers from the same starting hubs
+        string solvers[3] = {"multiBALL-hill", "multiBALL-weiszfeld", "multiBALL-coarse"};
+        for(int h = 0; h < 2; h++){
+            for(int m = 0; m < 3; m++){
+                settings opts;
+                opts.search = 0.01;
+                opts.minMax = 10;
+                opts.mode = m == 1 ? weiszfeld : hillClimbing;
+                opts.coarse = m == 2;
+                vector<hub> hubs = benchHubs(places, hubCounts[h], 3);
+                opInfo result;
+                seconds = timeRuns([&](){ result = multiBALL(hubs, places, opts); }, reps);
+                benchRow(solvers[m], n, hubCounts[h], reps, seconds, 0, result.addon.fitness);
+            }
+        }
+        
+        //Round trip for a single hub (2-opt gets slow past this)
+        if(n <= 20000){
+            opInfo single;
+            single.finals = benchHubs(places, 1, 5);
+            single.addon = findDualFitnesses(single.finals, places);
+            vector<collection> trips;
+            seconds = timeRuns([&](){ trips = tsp(places, single); }, reps);
+            benchRow("tsp", n, 1, reps, seconds, 0, trips[0].fitness);
+        }
     }
-    return output;
+}
+
+//Command line help
+void usage(){
+    cout << "Usage: LogisticsHub [dataset.csv|dataset.lhb] [options]\n";
+    cout << "  --convert in.csv out.lhb   write the binary dataset format and exit\n";
+    cout << "  --batch scenarios.txt      run every scenario in the file without prompting\n";
+    cout << "  --scenario \"hubs=3 ...\"    run one scenario (can be repeated)\n";
+    cout << "                             (sweep=1 solves 1 up to hubs, each from the last, one line each)\n";
+    cout << "                             (minpop=n and region=minLat,maxLat,minLon,maxLon only use some places)\n";
+    cout << "  --serve                    answer scenario lines from stdin on stdout, keeping the data loaded\n";
+    cout << "  --socket path              answer scenario lines on a Unix domain socket, one thread per client\n";
+    cout << "  --out results.jsonl        where batch results go (default stdout)\n";
+    cout << "  --generate n out [seed]    write a synthetic UK-like dataset (.csv or .lhb) and exit\n";
+    cout << "  --bench [low] [high]       benchmark kernels and solvers on 10^low..10^high places (default 3 5)\n";
+    cout << "  --profile                  count distance evaluations and time each phase, report to stderr\n";
+    cout << "  --seed n                   seed for the restarts (restart i uses n and i), reproducible runs\n";
+    cout << "  --uniform                  start hubs uniformly in the bounding box instead of k-means++\n";
+    cout << "  --coarse                   start optimising big datasets on merged grid cells, then refine\n";
+    cout << "  --budget seconds           solve until the time runs out, returning the best found (restarts are ignored)\n";
+    cout << "  --snapshot file            checkpoint the best hubs and assignments while solving\n";
+    cout << "  --resume file              start the first restart from a checkpoint with the same hub count\n";
+    cout << "                             (an unreadable or mismatched checkpoint is an error)\n";
+    cout << "  --abandon                  give up restarts that can't plausibly beat the best so far\n";
+    cout << "  --approx                   hill climb on float32 fitnesses (~1e-6 relative), then polish exactly\n";
+    cout << "  --temper                   run tempering chains (one per thread) instead of restarts, which become rounds\n";
+    cout << "  --shard result.txt         run one seeded scenario's restarts first=n onwards and write the best\n";
+    cout << "  --merge result.txt         merge shard results (can be repeated) into the best one, as JSON\n";
+    cout << "  --threads n                worker threads to use (default one per hardware thread), the\n";
+    cout << "                             main thread only sleeps while they run\n";
+    cout << "  --costs matrix.lhc         put hubs on the matrix's sites and price places (and square trips) by it\n";
+    cout << "  --write-costs in out.lhc   write great-circle costs between a dataset's places and exit\n";
 }
 
 //Starting up program
 int main(int argc, const char * argv[]) {
     opInfo moreData;
     opInfo bestData;
-    //Places have only numbers in [0, 0, pop, lat, long]
-    vector< vector <double> > places;
-    vector< vector <string> > placeName;
     vector<hub> best;
     vector<hub> hubs;
 
+    //Converting a csv to the binary format: --convert in.csv out.lhb
+    if(argc == 4 && string(argv[1]) == "--convert"){
+        writeDataset(loadDataset(argv[2]), argv[3]);
+        return 0;
+    }
+    //Writing great-circle costs between a dataset's places: --write-costs in out.lhc
+    if(argc == 4 && string(argv[1]) == "--write-costs"){
+        writeCosts(loadDataset(argv[2]).places, argv[3]);
+        return 0;
+    }
+    //Writing a synthetic dataset: --generate n out.(csv|lhb) [seed]
+    if((argc == 4 || argc == 5) && string(argv[1]) == "--generate"){
+        dataset synth = synthPlaces(atoll(argv[2]), argc == 5 ? strtoull(argv[4], nullptr, 10) : 1);
+        string outName = argv[3];
+        if(outName.size() > 4 && outName.compare(outName.size() - 4, 4, ".lhb") == 0){
+            writeDataset(synth, outName);
+        }else{
+            writeCsv(synth, outName);
+        }
+        return 0;
+    }
+    //Benchmarks on synthetic data: --bench [low] [high]
+    if(argc >= 2 && string(argv[1]) == "--bench"){
+        runBench(argc > 2 ? atoi(argv[2]) : 3, argc > 3 ? atoi(argv[3]) : 5);
+        return 0;
+    }
+    //Dataset can be given as an argument (csv or .lhb)
     string fileName = "GBplaces.csv";
+    string outName;
+    vector<string> batchLines;
+    bool batch = false;
+    bool serve = false;
+    string socketPath;
+    string costsName;
+    string shardName;
+    vector<string> mergeNames;
+    //Options given on the command line are the defaults for every run
+    settings opts;
+    for(int a = 1; a < argc; a++){
+        string arg = argv[a];
+        if(arg == "--batch" && a + 1 < argc){
+            ifstream file(argv[++a]);
+            if(!file.is_open()){
+                cout << argv[a] << " didn't open!" << "\n";
+                return 1;
+            }
+            string line;
+            while(getline(file, line)){
+                batchLines.push_back(line);
+            }
+            batch = true;
+        }else if(arg == "--scenario" && a + 1 < argc){
+            batchLines.push_back(argv[++a]);
+            batch = true;
+        }else if(arg == "--serve"){
+            serve = true;
+        }else if(arg == "--socket" && a + 1 < argc){
+            socketPath = argv[++a];
+        }else if(arg == "--out" && a + 1 < argc){
+            outName = argv[++a];
+        }else if(arg == "--profile"){
+            profile().enabled = true;
+        }else if(arg == "--seed" && a + 1 < argc){
+            opts.seed = strtoull(argv[++a], nullptr, 10);
+            opts.seeded = true;
+        }else if(arg == "--uniform"){
+            opts.start = uniformSeeding;
+        }else if(arg == "--coarse"){
+            opts.coarse = true;
+        }else if(arg == "--budget" && a + 1 < argc){
+            opts.budget = atof(argv[++a]);
+        }else if(arg == "--snapshot" && a + 1 < argc){
+            opts.snapshot = argv[++a];
+        }else if(arg == "--resume" && a + 1 < argc){
+            opts.resume = argv[++a];
+        }else if(arg == "--abandon"){
+            opts.abandon = true;
+        }else if(arg == "--approx"){
+            opts.approx = true;
+        }else if(arg == "--temper"){
+            opts.temper = true;
+        }else if(arg == "--costs" && a + 1 < argc){
+            costsName = argv[++a];
+        }else if(arg == "--shard" && a + 1 < argc){
+            shardName = argv[++a];
+        }else if(arg == "--merge" && a + 1 < argc){
+            mergeNames.push_back(argv[++a]);
+        }else if(arg == "--threads" && a + 1 < argc){
+            poolThreads = atoi(argv[++a]);
+        }else if(arg.compare(0, 2, "--") == 0){
+            usage();
+            return arg == "--help" ? 0 : 1;
+        }else{
+            fileName = arg;
+        }
+    }
+    
+    resetProfile();
+    //Reading file, once for every possibility
+    dataset loaded;
+    costMatrix costs;
+    {
+        phaseTimer timer(loadPhase);
+        //Only the interactive prompt talks on stdout, everything else keeps it for results
+        streambuf *console = cout.rdbuf();
+        if(batch || serve || !socketPath.empty() || !shardName.empty() || !mergeNames.empty()){
+            cout.rdbuf(cerr.rdbuf());
+        }
+        loaded = loadDataset(fileName);
+        if(!costsName.empty()){
+            costs = mapCosts(costsName);
+        }
+        cout.rdbuf(console);
+    }
+    if(!costsName.empty()){
+        if(costs.places != loaded.places.lat.size()){
+            cerr << costsName << " has costs for " << costs.places << " places, " << fileName << " has " << loaded.places.lat.size() << "!\n";
+            return 1;
+        }
+        opts.costs = &costs;
+    }
+    const placeTable &places = loaded.places;
+    const nameTable &placeName = loaded.names;
+    
+    if(!shardName.empty()){
+        int status = runShard(places, batchLines, shardName, opts);
+        if(profile().enabled){
+            writeProfile(cerr);
+        }
+        return status;
+    }
+    if(!mergeNames.empty()){
+        return mergeShards(places, mergeNames, outName, opts);
+    }
+    if(!socketPath.empty()){
+        return serveSocket(places, opts, socketPath);
+    }
+    if(serve){
+        serveStdio(places, opts);
+        return 0;
+    }
+    if(batch){
+        int status = runBatch(places, batchLines, outName, opts);
+        if(profile().enabled){
+            writeProfile(cerr);
+        }
+        return status;
+    }
     
-    int nums, loops, q, minMax;
+    int nums, loops, q, minMax, mode;
     double servicing, search;
     
     bool operating=true;
     while(operating){
-        double bestFit = INFINITY;
-        //Reading file
-        placesInfo information = getPlaces(fileName);
-        places = information.nums;
-        placeName = information.names;
-        
-        
         //Find boundaries
         bounds boundaries = getBounds(places);
         cout << "Min lat: " << boundaries.minLat << "; Max lat: " << boundaries.maxLat << "; Min long: " << boundaries.minLong << "; Max long: " << boundaries.maxLong << "\n";
         /*
          Requesting user input
         */
-        cout << "How many hubs would you like to place? (TSP will only be output for )\n";
+        cout << "How many hubs would you like to place?\n";
         cout << ">>";
         cin >> nums;
         
-        cout << "How many threads would you like to use to test? (Higher is more CPU intensive but can find better fits)\n";
+        cout << "How many random restarts would you like to test? (Higher takes longer but can find better fits, they share " << pool().size() << " threads)\n";
         cout << ">>";
         cin >> loops;
         
@@ -532,51 +4437,50 @@ int main(int argc, const char * argv[]) {
         cin >> search;
         search/=100;
         
-        cout << "What scope would you like to search for each iteration? (Optimium is 10)\n";
+        cout << "Which optimiser would you like to use for each hub?\n";
+        cout << "[0]:   Hill climb (grid search)\n";
+        cout << "[1]:   Weiszfeld (geometric median, converges in far fewer passes)\n";
         cout << ">>";
-        cin >> minMax;
+        cin >> mode;
+        
+        minMax = 0;
+        if(mode != weiszfeld){
+            cout << "What scope would you like to search for each iteration? (Optimium is 10)\n";
+            cout << ">>";
+            cin >> minMax;
+        }
+        opts.search = search;
+        opts.minMax = minMax;
+        opts.mode = mode == weiszfeld ? weiszfeld : hillClimbing;
         
         /*
          Performing calculations
         */
-        
-        //Looking at each possibility
-        vector<thread> threads;
-        vector<opInfo> data;
-        //Multithreading possibilities- concurrent calculations woo!
-        for(int i = 0; i < loops; i++){
-            threads.push_back(thread(possible, i, boundaries, nums, places, ref(data), minMax, search));
-        }
-        for(int i=0;i< threads.size();i++){
-            //Syncing threads
-            threads[i].join();
-        }
-        //Finding best result
-        for(int i=0;i<data.size();i++){
-            if(data[i].addon.fitness<bestFit){
-                bestFit = data[i].addon.fitness;
-                best = data[i].finals;
-                bestData = data[i];
-            }
-        }
-        threads.clear();
-        data.clear();
+        settings run = opts;
+        pickSeed(run);
+        cout << "Using seed " << run.seed << "\n";
+        bestData = solve(places, boundaries, nums, loops, run);
+        if(run.budget > 0 || run.abandon){
+            cout << "Ran " << bestData.restarts << " restarts, " << bestData.abandoned << " abandoned\n";
+        }
+        best = bestData.finals;
         cout << "Complete!\n\n";
         /*
          Calculations complete! Outputting data
         */
         //Finding TSP solution
-        vector<collection> trip=tsp(places, bestData);
+        vector<collection> trip=tsp(places, bestData, run.costs);
+        if(profile().enabled){
+            writeProfile(cerr);
+            resetProfile();
+        }
         //Adking user for data they want displayed
         cout << "Found " << nums << " hubs, with a total node length of "<< bestData.addon.fitness << ", would you like to see:\n";
         cout << "[0]:   Hub locations\n";
         cout << "[1]:   Hub locations and connections\n";
         cout << "[2]:   Hub locations, connections and number of people hub is servicing\n";
         cout << "[3]:   Hub locations and number of people hub is servicing\n";
-        //TSP only works with 1 hub
-        if(nums==1){
-            cout << "[4]:   Hub locations and round trip distances and connections\n";
-        }
+        cout << "[4]:   Hub locations and round trip distances and connections\n";
         cout << "[Else]:No output\n";
         cout << ">>";
         cin >> q;
@@ -585,14 +4489,12 @@ int main(int argc, const char * argv[]) {
             if(q >= 0 && q <= 4){
                 cout << "Hub " << (i+1) << " found at: " << best[i].lat << " , " << best[i].lon << "\n";
             }
-            if(q == 4 && nums == 1){
+            if(q == 4){
                 //TSP
                 cout << "Round trip is: " << trip[i].fitness << "km\n";
                 cout << "This round trip is to: \n";
                 for(int j=0;j<trip[i].connections.size();j++){
-                    if(trip[i].connections[j]!=100){
-                        cout << placeName[trip[i].connections[j]][0] <<"\n";
-                    }
+                    cout << getName(placeName, trip[i].connections[j]) <<"\n";
                 }
             }
             servicing = 0;
@@ -603,9 +4505,9 @@ int main(int argc, const char * argv[]) {
                 for(int j = 0; j < bestData.addon.connections.size(); j++){
                     if(bestData.addon.connections[j] == i){
                         if(q != 3){
-                            cout << placeName[j][0] << "\n";
+                            cout << getName(placeName, j) << "\n";
                         }
-                        servicing += places[j][2];
+                        servicing += places.pop[j];
                     }
                 }
             }